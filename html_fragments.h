@@ -47,10 +47,105 @@
 #define HTML_END "</html>"
 #define A_PRE_HREF "<a href=\""
 #define A_END "</a>"
+#define SCRIPT_START "<script>"
+#define SCRIPT_END "</script>"
+
+/*
+ * The few Bootstrap 3 rules the fragments below rely on, so pages render
+ * without fetching anything else.
+ */
+#define BUILTIN_CSS \
+	"*,:after,:before{box-sizing:border-box}" \
+	"html{font-size:10px;-webkit-text-size-adjust:100%}" \
+	"body{margin:0;font-family:\"Helvetica Neue\",Helvetica,Arial,sans-serif;" \
+		"font-size:14px;line-height:1.42857143;color:#333;background-color:#fff}" \
+	"a{color:#337ab7;text-decoration:none;background-color:transparent}" \
+	"a:focus,a:hover{color:#23527c;text-decoration:underline}" \
+	"h1{margin:20px 0 10px;font-family:inherit;font-size:36px;font-weight:500;line-height:1.1}" \
+	".container-fluid{padding-right:15px;padding-left:15px;margin-right:auto;margin-left:auto}" \
+	".row{margin-right:-15px;margin-left:-15px}" \
+	".col-md-12{position:relative;min-height:1px;padding-right:15px;padding-left:15px}" \
+	".table{width:100%;max-width:100%;margin-bottom:20px;background-color:transparent;" \
+		"border-collapse:collapse;border-spacing:0}" \
+	".table>thead>tr>th,.table>tbody>tr>td{padding:8px;line-height:1.42857143;" \
+		"text-align:left;vertical-align:top;border-top:1px solid #ddd}" \
+	".table>thead>tr>th{vertical-align:bottom;border-top:0;border-bottom:2px solid #ddd}" \
+	".table-condensed>thead>tr>th,.table-condensed>tbody>tr>td{padding:5px}" \
+	".table-striped>tbody>tr:nth-of-type(odd){background-color:#f9f9f9}" \
+	".table-responsive{min-height:.01%;overflow-x:auto}" \
+	".list-group{padding-left:0;margin-bottom:20px}" \
+	".list-group-item{position:relative;display:block;padding:10px 15px;margin-bottom:-1px;" \
+		"background-color:#fff;border:1px solid #ddd}" \
+	".list-group-item:first-child{border-top-left-radius:4px;border-top-right-radius:4px}" \
+	".list-group-item:last-child{margin-bottom:0;border-bottom-right-radius:4px;" \
+		"border-bottom-left-radius:4px}" \
+	".visible-sm,.visible-xs{display:none!important}" \
+	"@media (max-width:767px){.visible-xs{display:block!important}" \
+		".hidden-xs{display:none!important}}" \
+	"@media (min-width:768px) and (max-width:991px){.visible-sm{display:block!important}" \
+		".hidden-sm{display:none!important}}"
+
+
+
+/*
+ * responsiveindex_layout virtual: the page is a shell, and this script
+ * streams the listing in as NDJSON and only ever creates the rows in view.
+ * Entries come as ["name",1,mtime], ["name",1,mtime,size,files] for a
+ * directory with its tree totals, or ["name",0,mtime,size].
+ */
+#define VIRTUAL_JS \
+	"(function(){" \
+		"var H=30,L=document.getElementById('ri-list'),P=document.getElementById('ri-pad')," \
+		"V=document.getElementById('ri-rows'),X=L.getAttribute('data-exact')=='1'," \
+		"T=L.getAttribute('data-local')=='1',R=[['..',1]],Q=0," \
+		"M=['Jan','Feb','Mar','Apr','May','Jun','Jul','Aug','Sep','Oct','Nov','Dec'];" \
+		"function p(n){return n<10?'0'+n:''+n}" \
+		"function d(t){var x=new Date(t*1000);" \
+		"if(!T)x=new Date(t*1000+x.getTimezoneOffset()*60000);" \
+		"return p(x.getDate())+'-'+M[x.getMonth()]+'-'+x.getFullYear()+' '" \
+		"+p(x.getHours())+':'+p(x.getMinutes())}" \
+		"function z(s){if(X)return ''+s;" \
+		"if(s>1048575)return Math.round(s/1048576)+'M';" \
+		"if(s>9999)return Math.round(s/1024)+'K';return ''+s}" \
+		"function row(e,i){var r=document.createElement('div'),a=document.createElement('a')," \
+		"s=document.createElement('span'),u=document.createElement('span');" \
+		"r.className=i&1?'ri-row':'ri-row ri-odd';" \
+		"a.href=e[0]=='..'?'..':encodeURIComponent(e[0])+(e[1]?'/':'');a.textContent=e[0];" \
+		"if(e.length>2){s.textContent=d(e[2]);if(e.length<4)u.textContent='-';" \
+		"else{u.textContent=z(e[3]);if(e[1])u.title=e[4]+' files'}}" \
+		"r.appendChild(a);r.appendChild(s);r.appendChild(u);return r}" \
+		"function draw(){var f=Math.max(0,Math.floor(L.scrollTop/H)-10)," \
+		"l=Math.min(R.length,f+Math.ceil(L.clientHeight/H)+20)," \
+		"g=document.createDocumentFragment(),i;Q=0;" \
+		"P.style.height=R.length*H+'px';V.style.top=f*H+'px';" \
+		"for(i=f;i<l;i++)g.appendChild(row(R[i],i));V.textContent='';V.appendChild(g)}" \
+		"function q(){if(!Q){Q=1;requestAnimationFrame(draw)}}" \
+		"function add(s){if(s){s=JSON.parse(s);if(s instanceof Array)R.push(s)}}" \
+		"L.addEventListener('scroll',q);addEventListener('resize',q);q();" \
+		"fetch('?format=ndjson').then(function(r){var k,c,b='';if(!r.ok)throw r;" \
+		"k=r.body.getReader();c=new TextDecoder();" \
+		"function n(x){var i;if(x.done){add(b);q();return}" \
+		"b+=c.decode(x.value,{stream:true});" \
+		"while((i=b.indexOf('\\n'))>=0){add(b.slice(0,i));b=b.slice(i+1)}" \
+		"q();return k.read().then(n)}" \
+		"return k.read().then(n)}).catch(function(){location.search='?format=html'})" \
+	"})();"
+
+#define VIRTUAL_CSS \
+	"#ri-list{height:calc(100vh - 90px);overflow-y:auto;border-top:2px solid #ddd}" \
+	"#ri-pad{position:relative}" \
+	"#ri-rows{position:absolute;left:0;right:0}" \
+	".ri-row{display:flex;height:30px;line-height:30px;border-bottom:1px solid #ddd;white-space:nowrap}" \
+	".ri-odd{background-color:#f9f9f9}" \
+	".ri-row>*{padding:0 5px;overflow:hidden;text-overflow:ellipsis}" \
+	".ri-row>a{flex:1;min-width:0}" \
+	".ri-row>span{flex:none;width:150px}" \
+	".ri-row>span+span{width:80px}" \
+	"@media (max-width:767px){.ri-row>span{display:none}}"
 
 
 static ngx_str_t en = ngx_string("en");
-static ngx_str_t bootstrapcdn = ngx_string("//maxcdn.bootstrapcdn.com/bootstrap/3.3.7/css/bootstrap.min.css");
+static ngx_str_t builtin_css = ngx_string(BUILTIN_CSS);
 
 
 /* Blocks of the HTML to be written in order, with runtime data in between. */
@@ -69,12 +164,27 @@ static ngx_str_t to_stylesheet = ngx_string(
 	HEAD_START "\n"
 	CHARSET "\n"
 	VIEWPORT "\n"
-	LINK_PRE_HREF
+);
+
+
+/* Either a link to responsiveindex_bootstrap_href... */
+
+static ngx_str_t link_pre_href = ngx_string(LINK_PRE_HREF);
+
+
+static ngx_str_t link_post_href = ngx_string(LINK_POST_HREF "\n");
+
+
+/* ...or the built-in stylesheet. */
+
+static ngx_str_t inline_stylesheet = ngx_string(
+	STYLE_START
+	BUILTIN_CSS
+	STYLE_END "\n"
 );
 
 
 static ngx_str_t to_title = ngx_string(
-	TAG_END "\n"
 	STYLE_START "\n"
 	"body {" "\n"
 	"    word-wrap: break-word;" "\n"
@@ -181,5 +291,39 @@ static ngx_str_t to_html_end = ngx_string(
 );
 
 
+/* The virtual layout replaces everything after the heading with these. */
+
+static ngx_str_t virtual_style = ngx_string(
+	STYLE_START
+	VIRTUAL_CSS
+	STYLE_END "\n"
+);
+
+
+static ngx_str_t to_virtual_exact = ngx_string(
+	H1_END "\n"
+	"<div id=\"ri-list\" data-exact=\""
+);
+
+
+static ngx_str_t to_virtual_local = ngx_string("\" data-local=\"");
+
+
+static ngx_str_t to_virtual_end = ngx_string(
+	TAG_END
+	"<div id=\"ri-pad\"><div id=\"ri-rows\"></div></div>"
+	DIV_END "\n"
+	"<noscript>" A_PRE_HREF "?format=html" TAG_END "Plain listing" A_END "</noscript>\n"
+	SCRIPT_START
+	VIRTUAL_JS
+	SCRIPT_END "\n"
+	DIV_END "\n"
+	DIV_END "\n"
+	DIV_END "\n"
+	BODY_END "\n"
+	HTML_END "\n"
+);
+
+
 #endif
 
@@ -13,9 +13,15 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include <nginx.h>
 
 
 #include "html_fragments.h"
+#include "ngx_http_responsiveindex_uring.h"
+
+#if (NGX_HAVE_IO_URING_STATX)
+#include <sys/sysmacros.h>
+#endif
 
 typedef struct {
 	ngx_str_t	name;
@@ -25,624 +31,6513 @@ typedef struct {
 
 	unsigned	is_dir:1;
 
+	/* A directory's size and files are the totals of its tree (responsiveindex_dir_size). */
+	unsigned	sized:1;
+
+	/* Not included by name, so only listed if it turns out to be a directory. */
+	unsigned	dir_only:1;
+
 	time_t		mtime;
 	off_t		size;
+	ngx_uint_t	files;
+
+	/* The inode and its device, to find a directory's totals by (uniq 0 if unknown). */
+	ngx_file_uniq_t	uniq;
+	dev_t		dev;
 } ngx_http_responsiveindex_entry_t;
 
 
+/* A name found missing when a cached directory was reread, and when that was. */
+typedef struct {
+	ngx_str_t	name;
+	time_t		time;
+} ngx_http_responsiveindex_deleted_t;
+
+
+/* The sorted entries of one directory, plus what we knew about it when it was read. */
+typedef struct {
+	ngx_array_t			entries;
+
+	/* Directory mtime and inode, as seen just before it was read. */
+	time_t				mtime;
+	ngx_file_uniq_t		uniq;
+
+	/* When the read started, or when a cached copy was last found current. */
+	time_t				scanned;
+
+	/* From ?since: only entries changed after this are wanted (-1 for all of them). */
+	time_t				since;
+
+	/* Names deleted after since, or NULL if that is not known. */
+	ngx_array_t			*deleted;
+} ngx_http_responsiveindex_listing_t;
+
+
 typedef struct {
 	ngx_flag_t	enable;
 	ngx_flag_t	localtime;
 	ngx_flag_t	exact_size;
 
-	/* URI to load the Twitter bootstrap CSS from. */
+	/* URI to load the Twitter bootstrap CSS from (inlined built-in CSS if empty). */
 	ngx_str_t	bootstrap_href;
 
 	/* html LANG attribute value. */
 	ngx_str_t	lang;
 
-} ngx_http_responsiveindex_loc_conf_t;
+	/* A full HTML table, or a shell rendering only the rows in view. */
+	ngx_uint_t	layout;
 
+	/* Allow ?archive=tar and ?archive=zip. */
+	ngx_flag_t	archive;
 
-#define NGX_HTTP_AUTOINDEX_PREALLOCATE	255
-static int ngx_libc_cdecl ngx_http_responsiveindex_cmp_entries(const void *one,
-		const void *two);
-static ngx_int_t ngx_http_responsiveindex_error(ngx_http_request_t *r,
-		ngx_dir_t *dir, ngx_str_t *name);
-static ngx_int_t ngx_http_responsiveindex_init(ngx_conf_t *cf);
-static void *ngx_http_responsiveindex_create_loc_conf(ngx_conf_t *cf);
-static char *ngx_http_responsiveindex_merge_loc_conf(ngx_conf_t *cf,
-		void *parent, void *child);
+	/* Name of the thread pool to work out zip checksums in; zip is off if empty. */
+	ngx_str_t	archive_threads;
 
-static void ngx_http_responsiveindex_cpy_uri(ngx_buf_t *, ngx_http_responsiveindex_entry_t *);
+#if (NGX_THREADS)
+	ngx_thread_pool_t	*archive_pool;
+#endif
 
-static void ngx_http_responsiveindex_cpy_size(ngx_buf_t *, ngx_http_responsiveindex_entry_t *,
-		ngx_http_responsiveindex_loc_conf_t  *);
+	/* Shared zone to cache listings in (NULL if off). */
+	ngx_shm_zone_t	*cache;
 
+	/* How long a cached listing is trusted without looking at the directory. */
+	time_t		cache_valid;
 
-static ngx_command_t  ngx_http_responsiveindex_commands[] = {
+	/* Serve stale listings while they are being reread. */
+	ngx_flag_t	cache_background_update;
 
-	{
-		ngx_string("responsiveindex"),
-		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
-		ngx_conf_set_flag_slot,
-		NGX_HTTP_LOC_CONF_OFFSET,
-		offsetof(ngx_http_responsiveindex_loc_conf_t, enable),
-		NULL
-	},
+	/*
+	 * How many of the newest subdirectories of a listing to read into the
+	 * cache after it, how many such reads a worker runs at once, and how
+	 * long each of their slices may take.
+	 */
+	ngx_uint_t	prefetch;
+	ngx_uint_t	prefetch_concurrency;
+	ngx_msec_t	prefetch_budget;
 
-	{
-		ngx_string("responsiveindex_localtime"),
-		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
-		ngx_conf_set_flag_slot,
-		NGX_HTTP_LOC_CONF_OFFSET,
-		offsetof(ngx_http_responsiveindex_loc_conf_t, localtime),
-		NULL
-	},
+	/* Shared zone of directory tree totals (NULL if off), and how long they hold. */
+	ngx_shm_zone_t	*dir_size;
+	time_t		dir_size_valid;
 
-	{
-		ngx_string("responsiveindex_exact_size"),
-		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
-		ngx_conf_set_flag_slot,
-		NGX_HTTP_LOC_CONF_OFFSET,
-		offsetof(ngx_http_responsiveindex_loc_conf_t, exact_size),
-		NULL
-	},
+	/* Name of the thread pool to walk directory trees in ("default" if empty). */
+	ngx_str_t	dir_size_threads;
 
-	{
-		ngx_string("responsiveindex_bootstrap_href"),
-		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
-		ngx_conf_set_str_slot,
-		NGX_HTTP_LOC_CONF_OFFSET,
-		offsetof(ngx_http_responsiveindex_loc_conf_t, bootstrap_href),
-		NULL
-	},
+#if (NGX_THREADS)
+	ngx_thread_pool_t	*thread_pool;
+#endif
 
-	{
-		ngx_string("responsiveindex_lang"),
-		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
-		ngx_conf_set_str_slot,
-		NGX_HTTP_LOC_CONF_OFFSET,
-		offsetof(ngx_http_responsiveindex_loc_conf_t, lang),
-		NULL
-	},
+	/*
+	 * Listings of at least this many entries (0 for none) are sorted and
+	 * rendered in this many shards at once, on the named thread pool.
+	 */
+	ngx_uint_t	parallel;
+	ngx_uint_t	parallel_shards;
+	ngx_str_t	parallel_threads;
 
+#if (NGX_THREADS)
+	ngx_thread_pool_t	*parallel_pool;
+#endif
 
-	ngx_null_command
-};
+	/* Limits of one slice of a directory read. */
+	ngx_uint_t	scan_batch;
+	ngx_msec_t	scan_budget;
 
+	/* Stat the entries in batches through io_uring, where built in. */
+	ngx_flag_t	io_uring;
 
-static ngx_http_module_t ngx_http_responsiveindex_module_ctx = {
+	/* Patterns given to responsiveindex_exclude and responsiveindex_include. */
+	ngx_array_t	*exclude_patterns;
+	ngx_array_t	*include_patterns;
 
-	/* preconfiguration */
-	NULL,
+#if (NGX_PCRE)
+	/* The same patterns, each list compiled into a single alternation. */
+	ngx_regex_t	*exclude;
+	ngx_regex_t	*include;
+#endif
 
-	/* postconfiguration */
-	ngx_http_responsiveindex_init,
+	/*
+	 * The patterns, each as "e" or "i" for its list, then itself and a
+	 * '\0', so differently filtered listings are cached apart (empty if
+	 * none).
+	 */
+	ngx_str_t	filter;
 
-	/* create main configuration */
-	NULL,
+} ngx_http_responsiveindex_loc_conf_t;
 
-	/* init main configuration */
-	NULL,
 
-	/* create server configuration */
-	NULL,
+/*
+ * Cached entries are front-coded: sorted names share long prefixes, so each
+ * entry keeps only how much of the previous name it shares and the rest,
+ * and its mtime as the difference from the previous one, all as varints:
+ *
+ *     shared, (rest length << 1) | is_dir, rest,
+ *     zigzag(mtime delta), size of a file or inode and device of a directory
+ *
+ * Every NGX_HTTP_RESPONSIVEINDEX_RESTART-th entry is a restart point that
+ * shares nothing and has its mtime in full, so a poll can copy out and
+ * decode only the runs between them that hold something newer.
+ */
+#define NGX_HTTP_RESPONSIVEINDEX_RESTART	16
 
-	/* merge server configuration */
-	NULL,
 
-	/* create location configuration */
-	ngx_http_responsiveindex_create_loc_conf,
+/* A restart point of the cached entries. */
+typedef struct {
+	/* From the first entry. */
+	size_t			offset;
 
-	/* merge location configuration */
-	ngx_http_responsiveindex_merge_loc_conf
-};
+	/* The newest mtime of the run of entries it starts. */
+	time_t			mtime;
+} ngx_http_responsiveindex_restart_t;
 
 
-ngx_module_t ngx_http_responsiveindex_module = {
-	NGX_MODULE_V1,
+/* Where ngx_http_responsiveindex_decode() is in a coded run of entries. */
+typedef struct {
+	u_char			*pos;
 
-	/* module context */
-	&ngx_http_responsiveindex_module_ctx,
+	/* The last name decoded, '\0'-terminated; name_max + 1 long. */
+	u_char			*name;
 
-	/* module directives */
-	ngx_http_responsiveindex_commands,
+	time_t			mtime;
 
-	/* module type */
-	NGX_HTTP_MODULE,
+	/* How many entries were decoded, to tell the restart points by. */
+	ngx_uint_t		n;
+} ngx_http_responsiveindex_decoder_t;
 
-	/* init master */
-	NULL,
-	/* init module */
-	NULL,
 
-	/* init process */
-	NULL,
+typedef struct {
+	ngx_str_node_t		sn;
+	ngx_queue_t			queue;
 
-	/* init thread */
-	NULL,
+	time_t				mtime;
+	ngx_file_uniq_t		uniq;
 
-	/* exit thread */
-	NULL,
+	/* The last time the directory was found unchanged. */
+	time_t				checked;
 
-	/* exit process */
-	NULL,
+	/* When a background update was started, 0 if none is running. */
+	time_t				updating;
 
-	/* exit master */
-	NULL,
+	/* The coded entries, and the length of their names with a '\0' each. */
+	ngx_uint_t			nelts;
+	size_t				names_len;
+	u_char				*entries;
 
-	NGX_MODULE_V1_PADDING
-};
+	/* One for each run of NGX_HTTP_RESPONSIVEINDEX_RESTART entries. */
+	ngx_http_responsiveindex_restart_t	*restarts;
 
+	/* Names found gone on rereads, oldest first, coded the same; mtime is when that was noticed. */
+	ngx_uint_t			ndeleted;
+	u_char				*deleted;
 
-static ngx_int_t
-ngx_http_responsiveindex_handler(ngx_http_request_t *r)
-{
-	u_char						*last, *filename;
-	size_t						length, escape_html, allocated, root, response_size;
-	ngx_tm_t					tm;
-	ngx_err_t					err;
-	ngx_buf_t					*b;
-	ngx_int_t					rc;
-	ngx_str_t					path;
-	ngx_dir_t					dir;
-	ngx_uint_t					i, level, utf8;
-	ngx_pool_t					*pool;
-	ngx_time_t					*tp;
-	ngx_chain_t					out;
-	ngx_array_t					entries;
-	ngx_http_responsiveindex_entry_t	 *entry;
-	ngx_http_responsiveindex_loc_conf_t *conf;
+	/* The longest name of either. */
+	size_t				name_max;
 
-	static char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
-		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+	/* Every name deleted after this time is among them. */
+	time_t				deleted_from;
 
-	/* Only handle folders (this will allow files to be served). */
-	if (r->uri.data[r->uri.len - 1] != '/') {
-		return NGX_DECLINED;
-	}
+	/*
+	 * The newest mtime of the entries, and when the last of the deleted
+	 * names went (0 if none), so a poll past both needs no decoding.
+	 */
+	time_t				changed;
+	time_t				deleted_last;
 
-	/* This module ony handles GET and HEAD requests. */
-	if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
-		return NGX_DECLINED;
-	}
+	/* The end of the deleted names, which follow the entries. */
+	u_char				*last;
 
-	/* First we need to have access to the config. */
-	conf = ngx_http_get_module_loc_conf(r, ngx_http_responsiveindex_module);
+	/* Tells this copy from any stored later under the same key. */
+	ngx_uint_t			generation;
 
-	/* Make sure indexing is enabled. */
-	if (!conf->enable) {
-		return NGX_DECLINED;
-	}
+	/*
+	 * The directory mtime was older than the read, so nothing can have
+	 * changed within the same second without also changing the mtime.
+	 */
+	unsigned			exact:1;
 
-	/* NGX_DIR_MASK_LEN is lesser than NGX_HTTP_AUTOINDEX_PREALLOCATE */
+	u_char				key[1];
+} ngx_http_responsiveindex_cache_node_t;
 
-	/* Map the URI to a path. */
-	last = ngx_http_map_uri_to_path(r, &path, &root,
-			NGX_HTTP_AUTOINDEX_PREALLOCATE);
-	if (last == NULL) {
-		return NGX_HTTP_INTERNAL_SERVER_ERROR;
-	}
 
-	/* Set the actual path size. */
-	allocated = path.len;
-	path.len = last - path.data;
-	if (path.len > 1) {
-		path.len--;
-	}
-	path.data[path.len] = '\0';
+typedef struct {
+	ngx_rbtree_t		rbtree;
+	ngx_rbtree_node_t	sentinel;
+	ngx_queue_t			queue;
 
-	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"http responsiveindex: \"%s\"", path.data);
+	/* Of the last listing stored. */
+	ngx_uint_t			generation;
+} ngx_http_responsiveindex_cache_sh_t;
 
-	/* Open the path for reading. */
-	if (ngx_open_dir(&path, &dir) == NGX_ERROR) {
-		err = ngx_errno;
 
-		if (err == NGX_ENOENT
-				|| err == NGX_ENOTDIR
-				|| err == NGX_ENAMETOOLONG)
-		{
-			level = NGX_LOG_ERR;
-			rc = NGX_HTTP_NOT_FOUND;
+typedef struct {
+	ngx_http_responsiveindex_cache_sh_t	*sh;
+	ngx_slab_pool_t						*shpool;
+} ngx_http_responsiveindex_cache_t;
 
-		} else if (err == NGX_EACCES) {
-			level = NGX_LOG_ERR;
-			rc = NGX_HTTP_FORBIDDEN;
 
-		} else {
-			level = NGX_LOG_CRIT;
-			rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
-		}
+typedef struct ngx_http_responsiveindex_scan_s  ngx_http_responsiveindex_scan_t;
 
-		ngx_log_error(level, r->connection->log, err,
-				ngx_open_dir_n " \"%s\" failed", path.data);
+typedef void (*ngx_http_responsiveindex_scan_done_pt)(
+		ngx_http_responsiveindex_scan_t *scan, ngx_int_t rc);
 
-		return rc;
-	}
 
-#if (NGX_SUPPRESS_WARN)
+/*
+ * A directory being read. Big directories are read a slice at a time,
+ * going back to the event loop in between, so one listing does not hold
+ * up every other connection of the worker.
+ */
+struct ngx_http_responsiveindex_scan_s {
+	ngx_http_responsiveindex_listing_t	listing;
+
+	ngx_str_t							path;
+	ngx_dir_t							dir;
+
+	/* Where the listing goes in the cache. */
+	ngx_str_t							key;
+	u_char								*filename;
+	u_char								*last;
+	size_t								allocated;
 
-	/* MSVC thinks 'entries' may be used without having been initialized */
-	ngx_memzero(&entries, sizeof(ngx_array_t));
+	ngx_pool_t							*pool;
+	ngx_log_t							*log;
 
+	/* Limits of one slice, in ngx_read_dir calls and milliseconds (0 for none). */
+	ngx_uint_t							batch;
+	ngx_msec_t							budget;
+
+#if (NGX_PCRE)
+	ngx_regex_t							*exclude;
+	ngx_regex_t							*include;
 #endif
 
-	/* TODO: pool should be temporary pool */
-	pool = r->pool;
+#if (NGX_HAVE_IO_URING_STATX)
+	/* Ring to stat the entries with, a batch at a time (NULL for a stat() each). */
+	ngx_http_responsiveindex_uring_t	*uring;
 
-	if (ngx_array_init(&entries, pool, 40, sizeof(ngx_http_responsiveindex_entry_t))
-			!= NGX_OK)
-	{
-		return ngx_http_responsiveindex_error(r, &dir, &path);
-	}
+	/* The statx() calls in flight; scan->event is posted once they are done. */
+	ngx_http_responsiveindex_batch_t	*stats;
 
-	/* Set the headers (the response is HTML). */
-	r->headers_out.status = NGX_HTTP_OK;
-	r->headers_out.content_type_len = sizeof("text/html") - 1;
-	ngx_str_set(&r->headers_out.content_type, "text/html");
-	r->headers_out.content_type_lowcase = NULL;
+	/* Entries before this one are filled in, the rest still await their statx(). */
+	ngx_uint_t							stated;
+#endif
 
-	rc = ngx_http_send_header(r);
+	/*
+	 * Each slice sorts what it read, so entries before sorted are in runs,
+	 * ending where runs says (ngx_uint_t each), and these are merged a
+	 * slice at a time once the directory is read.
+	 */
+	ngx_uint_t							sorted;
+	ngx_array_t							runs;
+
+	/* Merging: the other buffer, the first run of the pair, and how far into each run it is. */
+	ngx_http_responsiveindex_entry_t	*spare;
+	ngx_uint_t							run;
+	ngx_uint_t							left;
+	ngx_uint_t							right;
+
+	/* How the listing goes out, one of NGX_HTTP_RESPONSIVEINDEX_FORMAT_*. */
+	ngx_uint_t							format;
+
+#if (NGX_THREADS)
+	/* Listings this long are left for ngx_http_responsiveindex_sort() (0 for none). */
+	ngx_uint_t							parallel;
+#endif
 
-	if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
-		if (ngx_close_dir(&dir) == NGX_ERROR) {
-			ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
-					ngx_close_dir_n " \"%V\" failed", &path);
-		}
+	/* Runs the next slice. */
+	ngx_event_t							event;
 
-		return rc;
-	}
+	/* Called once the directory is read, or could not be. */
+	ngx_http_responsiveindex_scan_done_pt	done;
+	void								*data;
 
-	filename = path.data;
-	filename[path.len] = '/';
+	unsigned							opened:1;
+	unsigned							eof:1;
+	unsigned							unsorted:1;
+};
 
-	if (r->headers_out.charset.len == 5
-			&& ngx_strncasecmp(r->headers_out.charset.data, (u_char *) "utf-8", 5)
-			== 0)
-	{
-		utf8 = 1;
 
-	} else {
-		utf8 = 0;
-	}
+/* One file in a zip archive, kept for the central directory at its end. */
+typedef struct {
+	ngx_str_t	name;
+	uint32_t	crc;
+	uint32_t	size;
+	uint32_t	offset;
+	uint16_t	time;
+	uint16_t	date;
+} ngx_http_responsiveindex_zip_entry_t;
 
-	/* Loop through all files. */
-	for ( ;; ) {
-		ngx_set_errno(0);
 
-		/* Read the directory, break when there are no more files. */
-		if (ngx_read_dir(&dir) == NGX_ERROR) {
-			err = ngx_errno;
+/* A file of the batch, opened and waiting to be chained up. */
+typedef struct {
+	ngx_http_responsiveindex_entry_t	*entry;
+	ngx_file_t							file;
+	off_t								size;
+	time_t								mtime;
 
-			if (err != NGX_ENOMOREFILES) {
-				ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
-						ngx_read_dir_n " \"%V\" failed", &path);
-				return ngx_http_responsiveindex_error(r, &dir, &path);
-			}
+	/* Zip only: the CRC32, and NGX_ERROR if it could not be worked out. */
+	uint32_t							crc;
+	ngx_int_t							rc;
+} ngx_http_responsiveindex_archive_file_t;
 
-			break;
-		}
 
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-				"http responsiveindex file: \"%s\"", ngx_de_name(&dir));
+/*
+ * A directory being sent as an archive. The files go out a batch at a
+ * time, as in_file buffers, and the next batch is only opened once the
+ * last one is sent, so neither memory nor open files grow with the size
+ * of the directory.
+ */
+typedef struct {
+	ngx_http_request_t					*request;
+	ngx_http_responsiveindex_loc_conf_t	*conf;
+
+	ngx_array_t							*entries;
+	ngx_uint_t							next;
 
-		length = ngx_de_namelen(&dir);
+	/* The directory, and the name of the archive's top directory with a '/'. */
+	ngx_str_t							path;
+	ngx_str_t							prefix;
 
-		/* Skip hidden files and folders. */
-		if (ngx_de_name(&dir)[0] == '.') {
-			continue;
-		}
+	ngx_uint_t							zip;
 
-		/* Get additional file info. */
-		if (!dir.valid_info) {
+	/* Bytes of the archive so far, and the files in it (zip only). */
+	off_t								offset;
+	ngx_array_t							*files;
+	u_char								*crc_buf;
 
-			/* 1 byte for '/' and 1 byte for terminating '\0' */
+	/* The batch being sent: its buffers and open files, and where the next link goes. */
+	ngx_pool_t							*pool;
+	ngx_chain_t							*out;
+	ngx_chain_t							**last;
 
-			if (path.len + 1 + length + 1 > allocated) {
-				allocated = path.len + 1 + length + 1
-					+NGX_HTTP_AUTOINDEX_PREALLOCATE;
+	ngx_http_responsiveindex_archive_file_t	*open;
+	ngx_uint_t							nopen;
 
-				filename = ngx_pnalloc(pool, allocated);
-				if (filename == NULL) {
-					return ngx_http_responsiveindex_error(r, &dir, &path);
-				}
+	unsigned							done:1;
 
-				/* Add the path to the filename and trailing slash. */
-				last = ngx_cpystrn(filename, path.data, path.len + 1);
-				*last++ = '/';
-			}
+	/* The checksums of the batch are being worked out on a thread. */
+	unsigned							summing:1;
+} ngx_http_responsiveindex_archive_t;
+
+
+/*
+ * The totals of a directory tree, keyed by the inode of the directory at
+ * its top, and told apart by its device, since inodes are only unique on
+ * one filesystem. They stand as long as that directory keeps the same
+ * mtime, up to responsiveindex_dir_size_valid: a change deeper down
+ * leaves it alone.
+ */
+typedef struct {
+	ngx_rbtree_node_t	node;
+	ngx_queue_t			queue;
 
-			/* Copy the actual filename into the path. */
-			ngx_cpystrn(last, ngx_de_name(&dir), length + 1);
+	dev_t				dev;
 
-			/* Get additional information about the file. */
-			if (ngx_de_info(filename, &dir) == NGX_FILE_ERROR) {
-				err = ngx_errno;
+	/* The directory's mtime the totals go with. */
+	time_t				mtime;
 
-				if (err != NGX_ENOENT && err != NGX_ELOOP) {
-					ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
-							ngx_de_info_n " \"%s\" failed", filename);
+	/* When the totals were worked out (0 if never), and when a walk was started. */
+	time_t				walked;
+	time_t				walking;
 
-					if (err == NGX_EACCES) {
-						continue;
-					}
+	off_t				size;
+	ngx_uint_t			files;
+} ngx_http_responsiveindex_size_node_t;
 
-					return ngx_http_responsiveindex_error(r, &dir, &path);
-				}
 
-				if (ngx_de_link_info(filename, &dir) == NGX_FILE_ERROR) {
-					ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-							ngx_de_link_info_n " \"%s\" failed",
-							filename);
-					return ngx_http_responsiveindex_error(r, &dir, &path);
-				}
-			}
-		}
+/* A directory tree being walked on the thread pool. */
+typedef struct {
+	ngx_shm_zone_t		*zone;
+	ngx_pool_t			*pool;
 
-		/* Push an entry into the array. */
-		entry = ngx_array_push(&entries);
-		if (entry == NULL) {
-			return ngx_http_responsiveindex_error(r, &dir, &path);
-		}
+	/* The directory, '\0'-terminated, and what it was listed with. */
+	ngx_str_t			path;
+	ngx_file_uniq_t		uniq;
+	dev_t				dev;
+	time_t				mtime;
 
-		/* Allocate memory for the file name. */
-		entry->name.len = length;
-		entry->name.data = ngx_pnalloc(pool, length + 1);
+	/* Set by the thread. */
+	off_t				size;
+	ngx_uint_t			files;
+	ngx_int_t			rc;
+} ngx_http_responsiveindex_walk_t;
 
-		/* Make sure we have allocated memory. */
-		if (entry->name.data == NULL) {
-			return ngx_http_responsiveindex_error(r, &dir, &path);
-		}
 
-		/* Assign file name. */
-		ngx_cpystrn(entry->name.data, ngx_de_name(&dir), length + 1);
+/* A subdirectory waiting to be read into the cache, or being read. */
+typedef struct {
+	ngx_queue_t							queue;
+	ngx_http_responsiveindex_loc_conf_t	*conf;
 
-		entry->escape = 2 * ngx_escape_uri(NULL, ngx_de_name(&dir), length,
-				NGX_ESCAPE_URI_COMPONENT);
+	/* Both '\0'-terminated. */
+	ngx_str_t							path;
+	ngx_str_t							key;
 
-		entry->escape_html = ngx_escape_html(NULL, entry->name.data,
-				entry->name.len);
+	unsigned							running:1;
+} ngx_http_responsiveindex_prefetch_t;
 
-		if (utf8) {
-			entry->utf_len = ngx_utf8_length(entry->name.data, entry->name.len);
-		} else {
-			entry->utf_len = length;
-		}
 
-		/* Assign file attributes. */
-		entry->is_dir = ngx_de_is_dir(&dir);
-		entry->mtime = ngx_de_mtime(&dir);
-		entry->size = ngx_de_size(&dir);
-	}
+/*
+ * A listing being reread in the background, after a stale copy was served,
+ * or read ahead of being asked for (prefetch is set then).
+ */
+typedef struct {
+	ngx_http_responsiveindex_scan_t		scan;
+	ngx_http_responsiveindex_loc_conf_t	*conf;
+	ngx_http_responsiveindex_prefetch_t	*prefetch;
+} ngx_http_responsiveindex_update_t;
+
+
+#if (NGX_THREADS)
+
+typedef struct ngx_http_responsiveindex_parallel_s  ngx_http_responsiveindex_parallel_t;
+
+typedef void (*ngx_http_responsiveindex_parallel_pt)(
+		ngx_http_responsiveindex_parallel_t *pl);
+
+
+/* One shard of a listing, and the task working on it. */
+typedef struct {
+	ngx_http_responsiveindex_parallel_t	*parallel;
+	ngx_thread_task_t					*task;
+
+	ngx_http_responsiveindex_entry_t	*entry;
+	ngx_uint_t							nelts;
+
+	/* To merge: the run after this one, and where both go. */
+	ngx_http_responsiveindex_entry_t	*next;
+	ngx_uint_t							next_nelts;
+	ngx_http_responsiveindex_entry_t	*out;
+
+	/* The rendered table rows and list items, in one ngx_alloc()ed block. */
+	u_char								*start;
+	ngx_buf_t							*rows;
+	ngx_buf_t							*items;
+} ngx_http_responsiveindex_shard_t;
+
+
+/*
+ * A listing sorted or rendered a shard per thread (responsiveindex_parallel).
+ * The shards go to the thread pool a round at a time, and done is called
+ * from the event loop once the whole round is through. The request is
+ * kept blocked meanwhile, so it cannot go away under the threads.
+ */
+struct ngx_http_responsiveindex_parallel_s {
+	ngx_http_request_t					*request;
+	ngx_http_responsiveindex_loc_conf_t	*conf;
+
+	/* Sorting: the scan, and the other half of the buffer the runs are merged between. */
+	ngx_http_responsiveindex_scan_t		*scan;
+	ngx_http_responsiveindex_entry_t	*spare;
+
+	/* Rendering: as ngx_http_responsiveindex_html() would. */
+	ngx_uint_t							utf8;
+	time_t								gmtoff;
+
+	ngx_http_responsiveindex_shard_t	*shards;
+	ngx_uint_t							nshards;
+
+	/* Tasks of the round not through yet. */
+	ngx_uint_t							pending;
+	ngx_http_responsiveindex_parallel_pt	done;
+
+	/* NGX_AGAIN until the listing is sorted or sent. */
+	ngx_int_t							rc;
+
+	/* Some round went through the event loop, so done has to finish the request. */
+	unsigned							async:1;
+};
+
+#endif
+
+
+#define NGX_HTTP_AUTOINDEX_PREALLOCATE	255
+
+
+#define NGX_HTTP_RESPONSIVEINDEX_LAYOUT_TABLE		0
+#define NGX_HTTP_RESPONSIVEINDEX_LAYOUT_VIRTUAL		1
+
+#define NGX_HTTP_RESPONSIVEINDEX_FORMAT_TABLE		0
+#define NGX_HTTP_RESPONSIVEINDEX_FORMAT_SHELL		1
+#define NGX_HTTP_RESPONSIVEINDEX_FORMAT_JSON		2
+#define NGX_HTTP_RESPONSIVEINDEX_FORMAT_NDJSON		3
+#define NGX_HTTP_RESPONSIVEINDEX_FORMAT_TAR			4
+#define NGX_HTTP_RESPONSIVEINDEX_FORMAT_ZIP			5
+
+/* Most files an archive has open at once. */
+#define NGX_HTTP_RESPONSIVEINDEX_ARCHIVE_BATCH	16
+
+/* Read size when working out the CRC of a file for a zip archive. */
+#define NGX_HTTP_RESPONSIVEINDEX_ARCHIVE_READ	65536
+
+#define NGX_HTTP_RESPONSIVEINDEX_TAR_BLOCK		512
+
+#define NGX_HTTP_RESPONSIVEINDEX_ZIP_LOCAL		30
+#define NGX_HTTP_RESPONSIVEINDEX_ZIP_CENTRAL	46
+#define NGX_HTTP_RESPONSIVEINDEX_ZIP_END		22
+
+/* Padding after a tar entry, and the two empty blocks that end a tar archive. */
+static u_char  ngx_http_responsiveindex_zeros[2 * NGX_HTTP_RESPONSIVEINDEX_TAR_BLOCK];
+
+/* Quoted CRC32 of the built-in stylesheet, set at configuration time. */
+static u_char builtin_css_etag_data[sizeof("\"01234567\"")];
+static ngx_str_t builtin_css_etag = { sizeof(builtin_css_etag_data) - 1, builtin_css_etag_data };
+
+/* A background update that has not finished by then is assumed to be lost. */
+#define NGX_HTTP_RESPONSIVEINDEX_UPDATE_TIMEOUT	60
+
+/* Seconds after which a directory tree walk is taken as lost and started again. */
+#define NGX_HTTP_RESPONSIVEINDEX_WALK_TIMEOUT	600
+
+/* The most subdirectories a worker keeps queued for reading ahead. */
+#define NGX_HTTP_RESPONSIVEINDEX_PREFETCH_MAX	64
+
+/* The most walks one listing starts; the other directories wait for later listings. */
+#define NGX_HTTP_RESPONSIVEINDEX_WALK_MAX		64
+
+/* Entries of a listing whose totals are looked up under one hold of the zone lock. */
+#define NGX_HTTP_RESPONSIVEINDEX_SIZE_CHUNK	256
+
+/* How many entries are read between looks at the clock. */
+#define NGX_HTTP_RESPONSIVEINDEX_CLOCK_EVERY	64
+
+/* Most deleted names remembered per cached directory. */
+#define NGX_HTTP_RESPONSIVEINDEX_DELETED_MAX	512
+
+static int ngx_libc_cdecl ngx_http_responsiveindex_cmp_entries(const void *one,
+		const void *two);
+static ngx_int_t ngx_http_responsiveindex_open_dir(ngx_log_t *log, ngx_str_t *path,
+		ngx_dir_t *dir);
+static ngx_int_t ngx_http_responsiveindex_scan_init(ngx_http_responsiveindex_scan_t *scan,
+		ngx_pool_t *pool, ngx_log_t *log, ngx_http_responsiveindex_loc_conf_t *conf);
+static ngx_int_t ngx_http_responsiveindex_scan_start(ngx_http_responsiveindex_scan_t *scan);
+static ngx_int_t ngx_http_responsiveindex_scan_step(ngx_http_responsiveindex_scan_t *scan);
+static ngx_int_t ngx_http_responsiveindex_scan_info(ngx_http_responsiveindex_scan_t *scan,
+		ngx_http_responsiveindex_entry_t *entry);
+static ngx_int_t ngx_http_responsiveindex_scan_stat(ngx_http_responsiveindex_scan_t *scan);
+static ngx_int_t ngx_http_responsiveindex_scan_run(ngx_http_responsiveindex_scan_t *scan);
+static ngx_int_t ngx_http_responsiveindex_scan_merge(ngx_http_responsiveindex_scan_t *scan,
+		ngx_msec_t start);
+#if (NGX_HAVE_IO_URING_STATX)
+static ngx_int_t ngx_http_responsiveindex_scan_stated(ngx_http_responsiveindex_scan_t *scan,
+		ngx_http_responsiveindex_batch_t *batch);
+#endif
+static void ngx_http_responsiveindex_scan_handler(ngx_event_t *ev);
+static void ngx_http_responsiveindex_scan_cleanup(void *data);
+#if (NGX_PCRE)
+static ngx_int_t ngx_http_responsiveindex_filtered(ngx_http_responsiveindex_scan_t *scan,
+		ngx_str_t *name);
+static ngx_regex_t *ngx_http_responsiveindex_compile(ngx_conf_t *cf,
+		ngx_array_t *patterns);
+static ngx_int_t ngx_http_responsiveindex_regex(ngx_conf_t *cf, ngx_str_t *re,
+		ngx_str_t *pattern);
+static ngx_uint_t ngx_http_responsiveindex_backref(u_char *p, u_char *end);
+#endif
+static void ngx_http_responsiveindex_scan_done(ngx_http_responsiveindex_scan_t *scan,
+		ngx_int_t rc);
+static ngx_uint_t ngx_http_responsiveindex_format(ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf);
+static ngx_int_t ngx_http_responsiveindex_send(ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf,
+		ngx_http_responsiveindex_listing_t *listing, ngx_uint_t format);
+static ngx_buf_t *ngx_http_responsiveindex_json(ngx_http_request_t *r,
+		ngx_http_responsiveindex_listing_t *listing);
+static ngx_buf_t *ngx_http_responsiveindex_ndjson(ngx_http_request_t *r,
+		ngx_http_responsiveindex_listing_t *listing);
+static ngx_buf_t *ngx_http_responsiveindex_shell(ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf);
+static ngx_int_t ngx_http_responsiveindex_archive(ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf,
+		ngx_http_responsiveindex_listing_t *listing, ngx_uint_t format);
+static ngx_int_t ngx_http_responsiveindex_archive_name(ngx_http_request_t *r,
+		ngx_str_t *prefix);
+static void ngx_http_responsiveindex_archive_handler(ngx_http_request_t *r);
+static void ngx_http_responsiveindex_archive_send(
+		ngx_http_responsiveindex_archive_t *ar);
+static ngx_int_t ngx_http_responsiveindex_archive_batch(
+		ngx_http_responsiveindex_archive_t *ar);
+static ngx_int_t ngx_http_responsiveindex_archive_open(
+		ngx_http_responsiveindex_archive_t *ar, ngx_http_responsiveindex_entry_t *entry,
+		off_t *end);
+static ngx_int_t ngx_http_responsiveindex_archive_chain(
+		ngx_http_responsiveindex_archive_t *ar);
+static ngx_int_t ngx_http_responsiveindex_archive_file(
+		ngx_http_responsiveindex_archive_t *ar, ngx_http_responsiveindex_archive_file_t *af);
+static ngx_int_t ngx_http_responsiveindex_archive_end(
+		ngx_http_responsiveindex_archive_t *ar);
+static ngx_int_t ngx_http_responsiveindex_archive_link(
+		ngx_http_responsiveindex_archive_t *ar, ngx_buf_t *b);
+#if (NGX_THREADS)
+static void ngx_http_responsiveindex_archive_crc_thread(void *data, ngx_log_t *log);
+static ngx_int_t ngx_http_responsiveindex_archive_crc(
+		ngx_http_responsiveindex_archive_file_t *af, u_char *buf);
+static void ngx_http_responsiveindex_archive_crc_done(ngx_event_t *ev);
+#endif
+static void ngx_http_responsiveindex_archive_cleanup(void *data);
+static u_char *ngx_http_responsiveindex_tar_header(u_char *p, ngx_str_t *prefix,
+		ngx_str_t *name, u_char type, off_t size, time_t mtime);
+static void ngx_http_responsiveindex_tar_number(u_char *p, size_t width, uint64_t n);
+static u_char *ngx_http_responsiveindex_put16(u_char *p, uint32_t n);
+static u_char *ngx_http_responsiveindex_put32(u_char *p, uint32_t n);
+static ngx_buf_t *ngx_http_responsiveindex_html(ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf, ngx_array_t *entries);
+static size_t ngx_http_responsiveindex_html_head(u_char *p, ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf);
+static void ngx_http_responsiveindex_html_sizes(ngx_http_responsiveindex_entry_t *entry,
+		ngx_uint_t n, ngx_uint_t utf8, size_t *rows, size_t *items);
+static void ngx_http_responsiveindex_html_rows(ngx_buf_t *b,
+		ngx_http_responsiveindex_loc_conf_t *conf, ngx_http_responsiveindex_entry_t *entry,
+		ngx_uint_t n, time_t gmtoff);
+static void ngx_http_responsiveindex_html_items(ngx_buf_t *b,
+		ngx_http_responsiveindex_entry_t *entry, ngx_uint_t n);
+static ngx_uint_t ngx_http_responsiveindex_utf8(ngx_http_request_t *r);
+static ngx_int_t ngx_http_responsiveindex_error(ngx_http_responsiveindex_scan_t *scan);
+static ngx_int_t ngx_http_responsiveindex_cache_key(ngx_pool_t *pool,
+		ngx_http_responsiveindex_loc_conf_t *conf, ngx_str_t *path, ngx_str_t *key);
+static ngx_int_t ngx_http_responsiveindex_cache_lookup(ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf, ngx_str_t *path, ngx_str_t *key,
+		ngx_http_responsiveindex_listing_t *listing);
+static ngx_int_t ngx_http_responsiveindex_cache_poll(ngx_http_request_t *r,
+		ngx_http_responsiveindex_cache_node_t *node, time_t since,
+		ngx_http_responsiveindex_cache_node_t *copy);
+static void ngx_http_responsiveindex_cache_store(ngx_shm_zone_t *zone,
+		ngx_str_t *key, ngx_http_responsiveindex_listing_t *listing);
+static ngx_int_t ngx_http_responsiveindex_cache_diff(
+		ngx_http_responsiveindex_cache_node_t *node,
+		ngx_http_responsiveindex_listing_t *listing, ngx_array_t *deleted, time_t *from);
+static ngx_uint_t ngx_http_responsiveindex_listed(ngx_array_t *entries, u_char *name,
+		size_t len);
+static size_t ngx_http_responsiveindex_encode(u_char *p,
+		ngx_http_responsiveindex_entry_t *entry, ngx_uint_t n,
+		ngx_http_responsiveindex_restart_t *restart);
+static void ngx_http_responsiveindex_decode(ngx_http_responsiveindex_decoder_t *d,
+		ngx_http_responsiveindex_entry_t *entry);
+static u_char *ngx_http_responsiveindex_put_varint(u_char *p, uint64_t n);
+static u_char *ngx_http_responsiveindex_get_varint(u_char *p, uint64_t *n);
+static size_t ngx_http_responsiveindex_varint_len(uint64_t n);
+static void ngx_http_responsiveindex_cache_delete(ngx_shm_zone_t *zone,
+		ngx_str_t *key);
+static ngx_int_t ngx_http_responsiveindex_cache_update(
+		ngx_http_responsiveindex_loc_conf_t *conf, ngx_str_t *path, ngx_str_t *key,
+		ngx_http_responsiveindex_prefetch_t *prefetch);
+static void ngx_http_responsiveindex_cache_update_done(
+		ngx_http_responsiveindex_scan_t *scan, ngx_int_t rc);
+static void ngx_http_responsiveindex_prefetch(ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf, ngx_array_t *entries);
+static void ngx_http_responsiveindex_prefetch_add(ngx_http_responsiveindex_loc_conf_t *conf,
+		ngx_str_t *path, ngx_str_t *key);
+static void ngx_http_responsiveindex_prefetch_next(void);
+static void ngx_http_responsiveindex_size_insert_value(ngx_rbtree_node_t *temp,
+		ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_responsiveindex_dir_sizes(ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf, ngx_array_t *entries);
+static ngx_http_responsiveindex_size_node_t *ngx_http_responsiveindex_size_lookup(
+		ngx_http_responsiveindex_cache_t *cache, ngx_file_uniq_t uniq, dev_t dev);
+static ngx_http_responsiveindex_size_node_t *ngx_http_responsiveindex_size_alloc(
+		ngx_http_responsiveindex_cache_t *cache, ngx_file_uniq_t uniq, dev_t dev);
+static ngx_int_t ngx_http_responsiveindex_walk(ngx_http_responsiveindex_loc_conf_t *conf,
+		ngx_str_t *path, ngx_http_responsiveindex_entry_t *entry);
+static void ngx_http_responsiveindex_walk_thread(void *data, ngx_log_t *log);
+static ngx_int_t ngx_http_responsiveindex_walk_file(ngx_tree_ctx_t *ctx, ngx_str_t *path);
+static ngx_int_t ngx_http_responsiveindex_walk_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path);
+static void ngx_http_responsiveindex_walk_done(ngx_event_t *ev);
+static ngx_int_t ngx_http_responsiveindex_sort(ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf, ngx_http_responsiveindex_scan_t *scan);
+static void ngx_http_responsiveindex_sort_thread(void *data, ngx_log_t *log);
+static void ngx_http_responsiveindex_merge(ngx_http_responsiveindex_parallel_t *pl);
+static void ngx_http_responsiveindex_merge_thread(void *data, ngx_log_t *log);
+static ngx_int_t ngx_http_responsiveindex_render(ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf, ngx_array_t *entries);
+static void ngx_http_responsiveindex_render_thread(void *data, ngx_log_t *log);
+static void ngx_http_responsiveindex_rendered(ngx_http_responsiveindex_parallel_t *pl);
+static void ngx_http_responsiveindex_render_cleanup(void *data);
+static ngx_http_responsiveindex_parallel_t *ngx_http_responsiveindex_parallel(
+		ngx_http_request_t *r, ngx_http_responsiveindex_loc_conf_t *conf,
+		ngx_http_responsiveindex_entry_t *entry, ngx_uint_t nelts);
+static void ngx_http_responsiveindex_parallel_run(ngx_http_responsiveindex_parallel_t *pl,
+		void (*handler)(void *data, ngx_log_t *log), ngx_http_responsiveindex_parallel_pt done);
+static void ngx_http_responsiveindex_parallel_handler(ngx_event_t *ev);
+#endif
+static ngx_int_t ngx_http_responsiveindex_cache_init_zone(ngx_shm_zone_t *shm_zone,
+		void *data);
+static ngx_int_t ngx_http_responsiveindex_css_handler(ngx_http_request_t *r);
+static char *ngx_http_responsiveindex_stylesheet(ngx_conf_t *cf, ngx_command_t *cmd,
+		void *conf);
+static char *ngx_http_responsiveindex_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+		void *conf);
+static char *ngx_http_responsiveindex_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+		void *conf);
+static char *ngx_http_responsiveindex_io_uring(ngx_conf_t *cf, void *post, void *data);
+static char *ngx_http_responsiveindex_filter(ngx_conf_t *cf, ngx_command_t *cmd,
+		void *conf);
+static ngx_int_t ngx_http_responsiveindex_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_responsiveindex_init_process(ngx_cycle_t *cycle);
+static void ngx_http_responsiveindex_exit_process(ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_responsiveindex_filter_key(ngx_conf_t *cf,
+		ngx_http_responsiveindex_loc_conf_t *conf);
+static void *ngx_http_responsiveindex_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_responsiveindex_merge_loc_conf(ngx_conf_t *cf,
+		void *parent, void *child);
+
+static void ngx_http_responsiveindex_cpy_uri(ngx_buf_t *, ngx_http_responsiveindex_entry_t *);
+
+static void ngx_http_responsiveindex_cpy_size(ngx_buf_t *, ngx_http_responsiveindex_entry_t *,
+		ngx_http_responsiveindex_loc_conf_t  *);
+
+
+static ngx_conf_enum_t  ngx_http_responsiveindex_layouts[] = {
+	{ ngx_string("table"), NGX_HTTP_RESPONSIVEINDEX_LAYOUT_TABLE },
+	{ ngx_string("virtual"), NGX_HTTP_RESPONSIVEINDEX_LAYOUT_VIRTUAL },
+	{ ngx_null_string, 0 }
+};
+
+
+static ngx_conf_post_t  ngx_http_responsiveindex_io_uring_post =
+	{ ngx_http_responsiveindex_io_uring };
+
+
+static ngx_conf_num_bounds_t  ngx_http_responsiveindex_shards_bounds = {
+	ngx_conf_check_num_bounds, 2, 64
+};
+
+
+/* Subdirectories to read ahead, in the order they were queued (set up in each worker), and how many are being read. */
+static ngx_queue_t  ngx_http_responsiveindex_prefetch_queue;
+static ngx_uint_t  ngx_http_responsiveindex_prefetch_queued;
+static ngx_uint_t  ngx_http_responsiveindex_prefetch_running;
+
+
+/* Tags the zones of responsiveindex_dir_size_zone apart from listing caches. */
+static ngx_uint_t  ngx_http_responsiveindex_dir_size_tag;
+
+
+static ngx_command_t  ngx_http_responsiveindex_commands[] = {
+
+	{
+		ngx_string("responsiveindex"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+		ngx_conf_set_flag_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, enable),
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_localtime"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+		ngx_conf_set_flag_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, localtime),
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_exact_size"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+		ngx_conf_set_flag_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, exact_size),
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_bootstrap_href"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+		ngx_conf_set_str_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, bootstrap_href),
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_lang"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+		ngx_conf_set_str_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, lang),
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_archive"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+		ngx_conf_set_flag_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, archive),
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_archive_threads"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+		ngx_conf_set_str_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, archive_threads),
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_layout"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+		ngx_conf_set_enum_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, layout),
+		&ngx_http_responsiveindex_layouts
+	},
+
+	{
+		ngx_string("responsiveindex_exclude"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+		ngx_http_responsiveindex_filter,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, exclude_patterns),
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_include"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+		ngx_http_responsiveindex_filter,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, include_patterns),
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_stylesheet"),
+		NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+		ngx_http_responsiveindex_stylesheet,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		0,
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_cache_zone"),
+		NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+		ngx_http_responsiveindex_cache_zone,
+		0,
+		0,
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_cache"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+		ngx_http_responsiveindex_cache,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, cache),
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_cache_valid"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+		ngx_conf_set_sec_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, cache_valid),
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_cache_background_update"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+		ngx_conf_set_flag_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, cache_background_update),
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_prefetch"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+		ngx_conf_set_num_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, prefetch),
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_prefetch_concurrency"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+		ngx_conf_set_num_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, prefetch_concurrency),
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_prefetch_budget"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+		ngx_conf_set_msec_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, prefetch_budget),
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_dir_size_zone"),
+		NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+		ngx_http_responsiveindex_cache_zone,
+		0,
+		0,
+		&ngx_http_responsiveindex_dir_size_tag
+	},
+
+	{
+		ngx_string("responsiveindex_dir_size"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+		ngx_http_responsiveindex_cache,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, dir_size),
+		&ngx_http_responsiveindex_dir_size_tag
+	},
+
+	{
+		ngx_string("responsiveindex_dir_size_valid"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+		ngx_conf_set_sec_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, dir_size_valid),
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_dir_size_threads"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+		ngx_conf_set_str_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, dir_size_threads),
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_parallel"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+		ngx_conf_set_num_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, parallel),
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_parallel_shards"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+		ngx_conf_set_num_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, parallel_shards),
+		&ngx_http_responsiveindex_shards_bounds
+	},
+
+	{
+		ngx_string("responsiveindex_parallel_threads"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+		ngx_conf_set_str_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, parallel_threads),
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_scan_batch"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+		ngx_conf_set_num_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, scan_batch),
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_scan_budget"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+		ngx_conf_set_msec_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, scan_budget),
+		NULL
+	},
+
+	{
+		ngx_string("responsiveindex_io_uring"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+		ngx_conf_set_flag_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_responsiveindex_loc_conf_t, io_uring),
+		&ngx_http_responsiveindex_io_uring_post
+	},
+
+
+	ngx_null_command
+};
+
+
+static ngx_http_module_t ngx_http_responsiveindex_module_ctx = {
+
+	/* preconfiguration */
+	NULL,
+
+	/* postconfiguration */
+	ngx_http_responsiveindex_init,
+
+	/* create main configuration */
+	NULL,
+
+	/* init main configuration */
+	NULL,
+
+	/* create server configuration */
+	NULL,
+
+	/* merge server configuration */
+	NULL,
+
+	/* create location configuration */
+	ngx_http_responsiveindex_create_loc_conf,
+
+	/* merge location configuration */
+	ngx_http_responsiveindex_merge_loc_conf
+};
+
+
+ngx_module_t ngx_http_responsiveindex_module = {
+	NGX_MODULE_V1,
+
+	/* module context */
+	&ngx_http_responsiveindex_module_ctx,
+
+	/* module directives */
+	ngx_http_responsiveindex_commands,
+
+	/* module type */
+	NGX_HTTP_MODULE,
+
+	/* init master */
+	NULL,
+	/* init module */
+	NULL,
+
+	/* init process */
+	ngx_http_responsiveindex_init_process,
+
+	/* init thread */
+	NULL,
+
+	/* exit thread */
+	NULL,
+
+	/* exit process */
+	ngx_http_responsiveindex_exit_process,
+
+	/* exit master */
+	NULL,
+
+	NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_responsiveindex_handler(ngx_http_request_t *r)
+{
+	u_char						*last;
+	size_t						root;
+	ngx_int_t					rc;
+	ngx_str_t					path, value;
+	ngx_dir_t					dir;
+	ngx_pool_cleanup_t			*cln;
+	ngx_http_responsiveindex_scan_t	 *scan;
+	ngx_http_responsiveindex_loc_conf_t *conf;
+
+	/* Only handle folders (this will allow files to be served). */
+	if (r->uri.data[r->uri.len - 1] != '/') {
+		return NGX_DECLINED;
+	}
+
+	/* This module ony handles GET and HEAD requests. */
+	if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+		return NGX_DECLINED;
+	}
+
+	/* First we need to have access to the config. */
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_responsiveindex_module);
+
+	/* Make sure indexing is enabled. */
+	if (!conf->enable) {
+		return NGX_DECLINED;
+	}
+
+	/* NGX_DIR_MASK_LEN is lesser than NGX_HTTP_AUTOINDEX_PREALLOCATE */
+
+	/* Map the URI to a path. */
+	last = ngx_http_map_uri_to_path(r, &path, &root,
+			NGX_HTTP_AUTOINDEX_PREALLOCATE);
+	if (last == NULL) {
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	/* Set the actual path size. */
+	path.len = last - path.data;
+	if (path.len > 1) {
+		path.len--;
+	}
+	path.data[path.len] = '\0';
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"http responsiveindex: \"%s\"", path.data);
+
+	/* TODO: pool should be temporary pool */
+	scan = ngx_pcalloc(r->pool, sizeof(ngx_http_responsiveindex_scan_t));
+	if (scan == NULL) {
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	if (ngx_http_responsiveindex_scan_init(scan, r->pool, r->connection->log, conf)
+			!= NGX_OK)
+	{
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	scan->path = path;
+
+	/* ?since=<epoch> asks only for what changed after that time. */
+	if (ngx_http_arg(r, (u_char *) "since", 5, &value) == NGX_OK) {
+		scan->listing.since = ngx_atotm(value.data, value.len);
+
+		if (scan->listing.since == NGX_ERROR) {
+			return NGX_HTTP_BAD_REQUEST;
+		}
+	}
+
+	scan->format = ngx_http_responsiveindex_format(r, conf);
+
+	/*
+	 * A HEAD request, or the shell of the virtual layout, only needs to
+	 * know the directory can be opened.
+	 */
+	if (r->method == NGX_HTTP_HEAD
+		|| scan->format == NGX_HTTP_RESPONSIVEINDEX_FORMAT_SHELL)
+	{
+		rc = ngx_http_responsiveindex_open_dir(r->connection->log, &path, &dir);
+		if (rc != NGX_OK) {
+			return rc;
+		}
+
+		if (ngx_close_dir(&dir) == NGX_ERROR) {
+			ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+					ngx_close_dir_n " \"%V\" failed", &path);
+		}
+
+		return ngx_http_responsiveindex_send(r, conf, &scan->listing, scan->format);
+	}
+
+	rc = NGX_DECLINED;
+
+	if (conf->cache) {
+		if (ngx_http_responsiveindex_cache_key(r->pool, conf, &path, &scan->key)
+				!= NGX_OK)
+		{
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+
+		rc = ngx_http_responsiveindex_cache_lookup(r, conf, &path, &scan->key,
+				&scan->listing);
+
+		if (rc == NGX_ERROR) {
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+	}
+
+	if (rc == NGX_OK) {
+		return ngx_http_responsiveindex_send(r, conf, &scan->listing, scan->format);
+	}
+
+	cln = ngx_pool_cleanup_add(r->pool, 0);
+	if (cln == NULL) {
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	cln->handler = ngx_http_responsiveindex_scan_cleanup;
+	cln->data = scan;
+
+	scan->done = ngx_http_responsiveindex_scan_done;
+	scan->data = r;
+
+#if (NGX_THREADS)
+	scan->parallel = conf->parallel;
+#endif
+
+	/* Small directories are read right away; the rest continue from the event loop. */
+	rc = ngx_http_responsiveindex_scan_step(scan);
+
+	if (rc == NGX_AGAIN || rc == NGX_BUSY) {
+		if (rc == NGX_AGAIN) {
+			ngx_add_timer(&scan->event, 0);
+		}
+
+		r->main->count++;
+
+		return NGX_DONE;
+	}
+
+	if (rc != NGX_OK) {
+		return rc;
+	}
+
+#if (NGX_THREADS)
+
+	if (scan->unsorted) {
+		rc = ngx_http_responsiveindex_sort(r, conf, scan);
+
+		if (rc == NGX_DONE) {
+			r->main->count++;
+			return NGX_DONE;
+		}
+
+		if (rc != NGX_OK) {
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+	}
+
+#endif
+
+	if (conf->cache) {
+		ngx_http_responsiveindex_cache_store(conf->cache, &scan->key, &scan->listing);
+	}
+
+	return ngx_http_responsiveindex_send(r, conf, &scan->listing, scan->format);
+}
+
+
+static void
+ngx_http_responsiveindex_scan_done(ngx_http_responsiveindex_scan_t *scan, ngx_int_t rc)
+{
+	ngx_connection_t					*c;
+	ngx_http_request_t					*r;
+	ngx_http_responsiveindex_loc_conf_t	*conf;
+
+	r = scan->data;
+	c = r->connection;
+
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_responsiveindex_module);
+
+#if (NGX_THREADS)
+
+	/* Called again once the threads have sorted it. */
+	if (rc == NGX_OK && scan->unsorted) {
+		rc = ngx_http_responsiveindex_sort(r, conf, scan);
+
+		if (rc == NGX_DONE) {
+			return;
+		}
+
+		if (rc != NGX_OK) {
+			rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+	}
+
+#endif
+
+	if (rc == NGX_OK) {
+		if (conf->cache) {
+			ngx_http_responsiveindex_cache_store(conf->cache, &scan->key,
+					&scan->listing);
+		}
+
+		rc = ngx_http_responsiveindex_send(r, conf, &scan->listing, scan->format);
+	}
+
+	ngx_http_finalize_request(r, rc);
+	ngx_http_run_posted_requests(c);
+}
+
+
+/*
+ * Picks the response format: ?archive=tar or ?archive=zip where allowed
+ * (zip only with responsiveindex_archive_threads),
+ * ?format=json, ?format=ndjson or ?format=html (the table, whatever the
+ * layout), else the one of responsiveindex_layout.
+ */
+static ngx_uint_t
+ngx_http_responsiveindex_format(ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf)
+{
+	ngx_str_t  value;
+
+	if (conf->archive
+		&& ngx_http_arg(r, (u_char *) "archive", 7, &value) == NGX_OK
+		&& value.len == 3)
+	{
+		if (ngx_strncmp(value.data, "tar", 3) == 0) {
+			return NGX_HTTP_RESPONSIVEINDEX_FORMAT_TAR;
+		}
+
+#if (NGX_THREADS)
+		/* Zip needs the checksums, which are worked out on the thread pool. */
+		if (conf->archive_pool && ngx_strncmp(value.data, "zip", 3) == 0) {
+			return NGX_HTTP_RESPONSIVEINDEX_FORMAT_ZIP;
+		}
+#endif
+	}
+
+	if (ngx_http_arg(r, (u_char *) "format", 6, &value) == NGX_OK) {
+
+		if (value.len == 4 && ngx_strncmp(value.data, "json", 4) == 0) {
+			return NGX_HTTP_RESPONSIVEINDEX_FORMAT_JSON;
+		}
+
+		if (value.len == 6 && ngx_strncmp(value.data, "ndjson", 6) == 0) {
+			return NGX_HTTP_RESPONSIVEINDEX_FORMAT_NDJSON;
+		}
+
+		if (value.len == 4 && ngx_strncmp(value.data, "html", 4) == 0) {
+			return NGX_HTTP_RESPONSIVEINDEX_FORMAT_TABLE;
+		}
+	}
+
+	if (conf->layout == NGX_HTTP_RESPONSIVEINDEX_LAYOUT_VIRTUAL) {
+		return NGX_HTTP_RESPONSIVEINDEX_FORMAT_SHELL;
+	}
+
+	return NGX_HTTP_RESPONSIVEINDEX_FORMAT_TABLE;
+}
+
+
+/* Sends the response for a listing that has been read or found in the cache. */
+static ngx_int_t
+ngx_http_responsiveindex_send(ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf,
+		ngx_http_responsiveindex_listing_t *listing, ngx_uint_t format)
+{
+	ngx_buf_t					*b;
+	ngx_int_t					rc;
+	ngx_str_t					value;
+	ngx_uint_t					i, n;
+	ngx_chain_t					out;
+	ngx_table_elt_t				*h;
+	ngx_http_responsiveindex_entry_t	 *entry;
+
+	/* Set the headers (the response is HTML, or JSON if asked for). */
+	r->headers_out.status = NGX_HTTP_OK;
+
+	switch (format) {
+
+	case NGX_HTTP_RESPONSIVEINDEX_FORMAT_JSON:
+		r->headers_out.content_type_len = sizeof("application/json") - 1;
+		ngx_str_set(&r->headers_out.content_type, "application/json");
+		break;
+
+	case NGX_HTTP_RESPONSIVEINDEX_FORMAT_NDJSON:
+		r->headers_out.content_type_len = sizeof("application/x-ndjson") - 1;
+		ngx_str_set(&r->headers_out.content_type, "application/x-ndjson");
+		break;
+
+	case NGX_HTTP_RESPONSIVEINDEX_FORMAT_TAR:
+		r->headers_out.content_type_len = sizeof("application/x-tar") - 1;
+		ngx_str_set(&r->headers_out.content_type, "application/x-tar");
+		break;
+
+	case NGX_HTTP_RESPONSIVEINDEX_FORMAT_ZIP:
+		r->headers_out.content_type_len = sizeof("application/zip") - 1;
+		ngx_str_set(&r->headers_out.content_type, "application/zip");
+		break;
+
+	default:
+		r->headers_out.content_type_len = sizeof("text/html") - 1;
+		ngx_str_set(&r->headers_out.content_type, "text/html");
+	}
+
+	r->headers_out.content_type_lowcase = NULL;
+
+	if (format == NGX_HTTP_RESPONSIVEINDEX_FORMAT_TAR
+		|| format == NGX_HTTP_RESPONSIVEINDEX_FORMAT_ZIP)
+	{
+		h = ngx_list_push(&r->headers_out.headers);
+		if (h == NULL) {
+			return NGX_ERROR;
+		}
+
+		if (ngx_http_responsiveindex_archive_name(r, &value) != NGX_OK) {
+			return NGX_ERROR;
+		}
+
+		/* Named after the directory, or "index" for the root. */
+
+		h->value.data = ngx_pnalloc(r->pool, sizeof("attachment; filename=\"index.tar\"")
+				+ value.len);
+		if (h->value.data == NULL) {
+			return NGX_ERROR;
+		}
+
+		h->hash = 1;
+#if (nginx_version >= 1023000)
+		h->next = NULL;
+#endif
+		ngx_str_set(&h->key, "Content-Disposition");
+		h->value.len = ngx_sprintf(h->value.data, "attachment; filename=\"%V.%s\"",
+				&value, format == NGX_HTTP_RESPONSIVEINDEX_FORMAT_TAR ? "tar" : "zip")
+			- h->value.data;
+	}
+
+	/* The time to pass as ?since on the next poll, so nothing is missed. */
+	if (listing->scanned) {
+		h = ngx_list_push(&r->headers_out.headers);
+		if (h == NULL) {
+			return NGX_ERROR;
+		}
+
+		h->value.data = ngx_pnalloc(r->pool, NGX_TIME_T_LEN);
+		if (h->value.data == NULL) {
+			return NGX_ERROR;
+		}
+
+		h->hash = 1;
+#if (nginx_version >= 1023000)
+		h->next = NULL;
+#endif
+		ngx_str_set(&h->key, "X-Responsiveindex-Time");
+		h->value.len = ngx_sprintf(h->value.data, "%T", listing->scanned - 1)
+			- h->value.data;
+	}
+
+	rc = ngx_http_send_header(r);
+
+	if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+		return rc;
+	}
+
+	/* Leave out what has not changed since ?since. */
+	if (listing->since != -1) {
+		entry = listing->entries.elts;
+
+		for (i = 0, n = 0; i < listing->entries.nelts; i++) {
+			if (entry[i].mtime > listing->since) {
+				entry[n++] = entry[i];
+			}
+		}
+
+		listing->entries.nelts = n;
+	}
+
+#if (NGX_THREADS)
+
+	if (conf->dir_size
+		&& format != NGX_HTTP_RESPONSIVEINDEX_FORMAT_TAR
+		&& format != NGX_HTTP_RESPONSIVEINDEX_FORMAT_ZIP
+		&& ngx_http_responsiveindex_dir_sizes(r, conf, &listing->entries) != NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+#endif
+
+	/* Polls stay within the directory, so there is nothing to read ahead for them. */
+	if (conf->prefetch && conf->cache && listing->since == -1
+		&& format != NGX_HTTP_RESPONSIVEINDEX_FORMAT_TAR
+		&& format != NGX_HTTP_RESPONSIVEINDEX_FORMAT_ZIP)
+	{
+		ngx_http_responsiveindex_prefetch(r, conf, &listing->entries);
+	}
+
+	switch (format) {
+
+	case NGX_HTTP_RESPONSIVEINDEX_FORMAT_SHELL:
+		b = ngx_http_responsiveindex_shell(r, conf);
+		break;
+
+	case NGX_HTTP_RESPONSIVEINDEX_FORMAT_JSON:
+		b = ngx_http_responsiveindex_json(r, listing);
+		break;
+
+	case NGX_HTTP_RESPONSIVEINDEX_FORMAT_NDJSON:
+		b = ngx_http_responsiveindex_ndjson(r, listing);
+		break;
+
+	case NGX_HTTP_RESPONSIVEINDEX_FORMAT_TAR:
+	case NGX_HTTP_RESPONSIVEINDEX_FORMAT_ZIP:
+		return ngx_http_responsiveindex_archive(r, conf, listing, format);
+
+	default:
+#if (NGX_THREADS)
+		if (conf->parallel && listing->entries.nelts >= conf->parallel) {
+			return ngx_http_responsiveindex_render(r, conf, &listing->entries);
+		}
+#endif
+		b = ngx_http_responsiveindex_html(r, conf, &listing->entries);
+	}
+
+	if (b == NULL) {
+		return NGX_ERROR;
+	}
+
+	/* Last buffer in chain. */
+	if (r == r->main) {
+		b->last_buf = 1;
+	}
+
+	b->last_in_chain = 1;
+
+	/* Attach this buffer to the buffer chain. */
+	out.buf = b;
+	out.next = NULL;
+
+	/* Send the buffer chain of the response. */
+	return ngx_http_output_filter(r, &out);
+}
+
+
+static ngx_int_t
+ngx_http_responsiveindex_open_dir(ngx_log_t *log, ngx_str_t *path, ngx_dir_t *dir)
+{
+	ngx_err_t	err;
+	ngx_int_t	rc;
+	ngx_uint_t	level;
+
+	/* Open the path for reading. */
+	if (ngx_open_dir(path, dir) != NGX_ERROR) {
+		return NGX_OK;
+	}
+
+	err = ngx_errno;
+
+	if (err == NGX_ENOENT
+			|| err == NGX_ENOTDIR
+			|| err == NGX_ENAMETOOLONG)
+	{
+		level = NGX_LOG_ERR;
+		rc = NGX_HTTP_NOT_FOUND;
+
+	} else if (err == NGX_EACCES) {
+		level = NGX_LOG_ERR;
+		rc = NGX_HTTP_FORBIDDEN;
+
+	} else {
+		level = NGX_LOG_CRIT;
+		rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	ngx_log_error(level, log, err, ngx_open_dir_n " \"%s\" failed", path->data);
+
+	return rc;
+}
+
+
+static ngx_int_t
+ngx_http_responsiveindex_scan_init(ngx_http_responsiveindex_scan_t *scan,
+		ngx_pool_t *pool, ngx_log_t *log, ngx_http_responsiveindex_loc_conf_t *conf)
+{
+	if (ngx_array_init(&scan->listing.entries, pool, 40,
+				sizeof(ngx_http_responsiveindex_entry_t))
+			!= NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	if (ngx_array_init(&scan->runs, pool, 8, sizeof(ngx_uint_t)) != NGX_OK) {
+		return NGX_ERROR;
+	}
+
+	scan->listing.since = -1;
+
+	scan->pool = pool;
+	scan->log = log;
+	scan->batch = conf->scan_batch;
+	scan->budget = conf->scan_budget;
+
+#if (NGX_PCRE)
+	scan->exclude = conf->exclude;
+	scan->include = conf->include;
+#endif
+
+#if (NGX_HAVE_IO_URING_STATX)
+	if (conf->io_uring) {
+		scan->uring = ngx_http_responsiveindex_uring_get(log);
+	}
+#endif
+
+	scan->event.handler = ngx_http_responsiveindex_scan_handler;
+	scan->event.data = scan;
+	scan->event.log = log;
+
+	return NGX_OK;
+}
+
+
+/*
+ * Opens the directory at scan->path (which must be '\0'-terminated).
+ * Returns NGX_OK, or the HTTP status to fail with.
+ */
+static ngx_int_t
+ngx_http_responsiveindex_scan_start(ngx_http_responsiveindex_scan_t *scan)
+{
+	ngx_int_t					rc;
+	ngx_file_info_t				fi;
+
+	scan->listing.scanned = ngx_time();
+
+	rc = ngx_http_responsiveindex_open_dir(scan->log, &scan->path, &scan->dir);
+	if (rc != NGX_OK) {
+		return rc;
+	}
+
+	scan->opened = 1;
+
+	/* Note the directory state before reading it, so a change during the read is not missed. */
+	if (ngx_file_info(scan->path.data, &fi) == NGX_FILE_ERROR) {
+		ngx_log_error(NGX_LOG_CRIT, scan->log, ngx_errno,
+				ngx_file_info_n " \"%s\" failed", scan->path.data);
+		return ngx_http_responsiveindex_error(scan);
+	}
+
+	scan->listing.mtime = ngx_file_mtime(&fi);
+	scan->listing.uniq = ngx_file_uniq(&fi);
+
+	/* 1 byte for '/' and 1 byte for terminating '\0' */
+	scan->allocated = scan->path.len + 1 + NGX_HTTP_AUTOINDEX_PREALLOCATE + 1;
+
+	scan->filename = ngx_pnalloc(scan->pool, scan->allocated);
+	if (scan->filename == NULL) {
+		return ngx_http_responsiveindex_error(scan);
+	}
+
+	scan->last = ngx_cpymem(scan->filename, scan->path.data, scan->path.len);
+	*scan->last++ = '/';
+
+	return NGX_OK;
+}
+
+
+/*
+ * Reads the next slice of the directory. Returns NGX_AGAIN if there is
+ * more to read or merge, NGX_BUSY while statx() calls are in flight
+ * (scan->event is posted once they are done), NGX_OK once the listing is
+ * complete and sorted, or the HTTP status to fail with.
+ */
+static ngx_int_t
+ngx_http_responsiveindex_scan_step(ngx_http_responsiveindex_scan_t *scan)
+{
+	size_t						length;
+	ngx_err_t					err;
+	ngx_int_t					rc;
+	ngx_uint_t					n;
+	ngx_msec_t					start;
+	ngx_dir_t					*dir;
+	ngx_str_t					*path;
+#if (NGX_PCRE)
+	ngx_str_t					name;
+#endif
+	ngx_uint_t					dir_only;
+	ngx_http_responsiveindex_entry_t	 *entry;
+#if (NGX_HAVE_IO_URING_STATX)
+	ngx_http_responsiveindex_batch_t	 *batch;
+#endif
+
+	if (scan->filename == NULL) {
+		rc = ngx_http_responsiveindex_scan_start(scan);
+		if (rc != NGX_OK) {
+			return rc;
+		}
+	}
+
+#if (NGX_HAVE_IO_URING_STATX)
+
+	if (scan->stats) {
+		if (scan->stats->pending) {
+			return NGX_BUSY;
+		}
+
+		batch = scan->stats;
+		scan->stats = NULL;
+
+		rc = ngx_http_responsiveindex_scan_stated(scan, batch);
+
+		ngx_http_responsiveindex_uring_free(batch);
+
+		if (rc != NGX_OK) {
+			return rc;
+		}
+	}
+
+#endif
+
+	dir = &scan->dir;
+	path = &scan->path;
+
+	if (scan->budget) {
+		ngx_time_update();
+	}
+
+	start = ngx_current_msec;
+
+	/* Loop through all files. */
+	for (n = 0; !scan->eof; n++) {
+
+		if (scan->batch && n == scan->batch) {
+			goto again;
+		}
+
+		if (scan->budget && n && n % NGX_HTTP_RESPONSIVEINDEX_CLOCK_EVERY == 0) {
+			ngx_time_update();
+
+			if (ngx_current_msec - start >= scan->budget) {
+				goto again;
+			}
+		}
+
+		ngx_set_errno(0);
+
+		/* Read the directory, break when there are no more files. */
+		if (ngx_read_dir(dir) == NGX_ERROR) {
+			err = ngx_errno;
+
+			if (err != NGX_ENOMOREFILES) {
+				ngx_log_error(NGX_LOG_CRIT, scan->log, err,
+						ngx_read_dir_n " \"%V\" failed", path);
+				return ngx_http_responsiveindex_error(scan);
+			}
+
+			scan->eof = 1;
+			break;
+		}
+
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, scan->log, 0,
+				"http responsiveindex file: \"%s\"", ngx_de_name(dir));
+
+		length = ngx_de_namelen(dir);
+
+		/* Skip hidden files and folders. */
+		if (ngx_de_name(dir)[0] == '.') {
+			continue;
+		}
+
+		dir_only = 0;
+
+#if (NGX_PCRE)
+
+		/* Filtered out entries cost nothing beyond the ngx_read_dir call. */
+		if (scan->exclude || scan->include) {
+			name.len = length;
+			name.data = ngx_de_name(dir);
+
+			rc = ngx_http_responsiveindex_filtered(scan, &name);
+
+			if (rc == NGX_DECLINED) {
+				continue;
+			}
+
+			dir_only = (rc == NGX_AGAIN);
+
+#if (NGX_HAVE_D_TYPE)
+			/* Where readdir knows the type, a file left out costs no stat either. */
+			if (dir_only && dir->type && dir->type != DT_LNK) {
+				if (dir->type != DT_DIR) {
+					continue;
+				}
+
+				dir_only = 0;
+			}
+#endif
+		}
+
+#endif
+
+		/* Push an entry into the array. */
+		entry = ngx_array_push(&scan->listing.entries);
+		if (entry == NULL) {
+			return ngx_http_responsiveindex_error(scan);
+		}
+
+		/* Allocate memory for the file name. */
+		entry->name.len = length;
+		entry->name.data = ngx_pnalloc(scan->pool, length + 1);
+
+		/* Make sure we have allocated memory. */
+		if (entry->name.data == NULL) {
+			return ngx_http_responsiveindex_error(scan);
+		}
+
+		/* Assign file name. */
+		ngx_cpystrn(entry->name.data, ngx_de_name(dir), length + 1);
+
+		entry->sized = 0;
+		entry->dir_only = dir_only;
+		entry->files = 0;
+
+		/* Assign file attributes. */
+		if (dir->valid_info) {
+			entry->is_dir = ngx_de_is_dir(dir);
+			entry->mtime = ngx_de_mtime(dir);
+			entry->size = ngx_de_size(dir);
+			entry->uniq = 0;
+			entry->dev = 0;
+
+			if (entry->dir_only && !entry->is_dir) {
+				scan->listing.entries.nelts--;
+			}
+
+			continue;
+		}
+
+#if (NGX_HAVE_IO_URING_STATX)
+
+		/* Left for the next batch of statx() calls. */
+		if (scan->uring) {
+			if (scan->listing.entries.nelts - scan->stated
+				== ngx_http_responsiveindex_uring_size(scan->uring))
+			{
+				rc = ngx_http_responsiveindex_scan_stat(scan);
+				if (rc != NGX_OK) {
+					return rc;
+				}
+			}
+
+			continue;
+		}
+
+#endif
+
+		rc = ngx_http_responsiveindex_scan_info(scan, entry);
+
+		if (rc == NGX_DECLINED || (rc == NGX_OK && entry->dir_only && !entry->is_dir)) {
+			scan->listing.entries.nelts--;
+			continue;
+		}
+
+		if (rc != NGX_OK) {
+			return rc;
+		}
+	}
+
+	rc = ngx_http_responsiveindex_scan_stat(scan);
+	if (rc != NGX_OK) {
+		return rc;
+	}
+
+	/* Close the directory (the slices merging the runs find it closed). */
+	if (scan->opened) {
+		scan->opened = 0;
+
+		if (ngx_close_dir(dir) == NGX_ERROR) {
+			ngx_log_error(NGX_LOG_ALERT, scan->log, ngx_errno,
+					ngx_close_dir_n " \"%V\" failed", path);
+		}
+	}
+
+#if (NGX_THREADS)
+
+	/* A huge listing is sorted across threads once the read is done. */
+	if (scan->parallel && scan->listing.entries.nelts >= scan->parallel) {
+		scan->unsorted = 1;
+		return NGX_OK;
+	}
+
+#endif
+
+	/* Sort the last run, then merge them all, a slice at a time. */
+	if (ngx_http_responsiveindex_scan_run(scan) != NGX_OK) {
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	rc = ngx_http_responsiveindex_scan_merge(scan, start);
+
+	return rc == NGX_ERROR ? NGX_HTTP_INTERNAL_SERVER_ERROR : rc;
+
+again:
+
+	if (ngx_http_responsiveindex_scan_run(scan) != NGX_OK) {
+		return ngx_http_responsiveindex_error(scan);
+	}
+
+	return NGX_AGAIN;
+}
+
+
+/*
+ * Sorts the entries filled in since the last run into a run of their own.
+ * Returns NGX_OK, or NGX_ERROR.
+ */
+static ngx_int_t
+ngx_http_responsiveindex_scan_run(ngx_http_responsiveindex_scan_t *scan)
+{
+	ngx_uint_t	n, *end;
+
+	n = scan->listing.entries.nelts;
+
+#if (NGX_HAVE_IO_URING_STATX)
+	/* The rest are not known to be files or directories yet. */
+	if (scan->uring) {
+		n = scan->stated;
+	}
+#endif
+
+	if (n == scan->sorted) {
+		return NGX_OK;
+	}
+
+	ngx_qsort((ngx_http_responsiveindex_entry_t *) scan->listing.entries.elts
+			+ scan->sorted, (size_t) (n - scan->sorted),
+			sizeof(ngx_http_responsiveindex_entry_t),
+			ngx_http_responsiveindex_cmp_entries);
+
+	end = ngx_array_push(&scan->runs);
+	if (end == NULL) {
+		return NGX_ERROR;
+	}
+
+	*end = n;
+	scan->sorted = n;
+
+	return NGX_OK;
+}
+
+
+/*
+ * Merges the runs in pairs, pass after pass, into the other buffer and
+ * back, until one is left, within the limits of a slice that started at
+ * start. Returns NGX_AGAIN if they ran out first (the next call goes on
+ * from there), NGX_OK once the listing is a single run, or NGX_ERROR.
+ */
+static ngx_int_t
+ngx_http_responsiveindex_scan_merge(ngx_http_responsiveindex_scan_t *scan,
+		ngx_msec_t start)
+{
+	ngx_uint_t							i, j, k, n, mid, last, *end;
+	ngx_http_responsiveindex_entry_t	*src, *dst, *out;
+
+	if (scan->runs.nelts < 2) {
+		return NGX_OK;
+	}
+
+	end = scan->runs.elts;
+
+	if (scan->spare == NULL) {
+		scan->spare = ngx_palloc(scan->pool,
+				scan->listing.entries.nelts * sizeof(ngx_http_responsiveindex_entry_t));
+		if (scan->spare == NULL) {
+			return NGX_ERROR;
+		}
+
+		scan->run = 0;
+		scan->left = 0;
+		scan->right = end[0];
+	}
+
+	n = 0;
+
+	for ( ;; ) {
+		k = scan->runs.nelts;
+		src = scan->listing.entries.elts;
+		dst = scan->spare;
+
+		/* The odd run out at the end of a pass is merged with nothing. */
+		mid = end[scan->run];
+		last = (scan->run + 1 < k) ? end[scan->run + 1] : mid;
+
+		while (scan->left < mid && scan->right < last) {
+
+			if (scan->batch && n == scan->batch) {
+				return NGX_AGAIN;
+			}
+
+			if (scan->budget && n && n % NGX_HTTP_RESPONSIVEINDEX_CLOCK_EVERY == 0) {
+				ngx_time_update();
+
+				if (ngx_current_msec - start >= scan->budget) {
+					return NGX_AGAIN;
+				}
+			}
+
+			/* Both runs go to the same place in the other buffer, so that is where they are. */
+			out = &dst[scan->left + scan->right - mid];
+
+			if (ngx_http_responsiveindex_cmp_entries(&src[scan->right], &src[scan->left]) < 0) {
+				*out = src[scan->right++];
+
+			} else {
+				*out = src[scan->left++];
+			}
+
+			n++;
+		}
+
+		ngx_memcpy(&dst[scan->left + scan->right - mid], &src[scan->left],
+				(mid - scan->left) * sizeof(ngx_http_responsiveindex_entry_t));
+
+		ngx_memcpy(&dst[scan->right], &src[scan->right],
+				(last - scan->right) * sizeof(ngx_http_responsiveindex_entry_t));
+
+		scan->run += 2;
+
+		if (scan->run >= k) {
+
+			/* The pass is through: every second run end goes, and the buffers change places. */
+
+			for (i = 1, j = 0; i < k; i += 2) {
+				end[j++] = end[i];
+			}
+
+			if (k % 2) {
+				end[j++] = end[k - 1];
+			}
+
+			scan->runs.nelts = j;
+
+			scan->listing.entries.elts = dst;
+			scan->listing.entries.nalloc = scan->listing.entries.nelts;
+			scan->spare = src;
+			scan->run = 0;
+
+			if (j == 1) {
+				return NGX_OK;
+			}
+		}
+
+		scan->left = scan->run ? end[scan->run - 1] : 0;
+		scan->right = end[scan->run];
+	}
+}
+
+
+/*
+ * Fills in an entry with stat(), or lstat() for a dangling symlink.
+ * Returns NGX_OK, NGX_DECLINED to leave the entry out, or the HTTP
+ * status to fail with.
+ */
+static ngx_int_t
+ngx_http_responsiveindex_scan_info(ngx_http_responsiveindex_scan_t *scan,
+		ngx_http_responsiveindex_entry_t *entry)
+{
+	ngx_err_t					err;
+	ngx_dir_t					*dir;
+	ngx_str_t					*path;
+
+	dir = &scan->dir;
+	path = &scan->path;
+
+	/* 1 byte for '/' and 1 byte for terminating '\0' */
+
+	if (path->len + 1 + entry->name.len + 1 > scan->allocated) {
+		scan->allocated = path->len + 1 + entry->name.len + 1
+			+NGX_HTTP_AUTOINDEX_PREALLOCATE;
+
+		scan->filename = ngx_pnalloc(scan->pool, scan->allocated);
+		if (scan->filename == NULL) {
+			return ngx_http_responsiveindex_error(scan);
+		}
+
+		/* Add the path to the filename and trailing slash. */
+		scan->last = ngx_cpystrn(scan->filename, path->data, path->len + 1);
+		*scan->last++ = '/';
+	}
+
+	/* Copy the actual filename into the path. */
+	ngx_cpystrn(scan->last, entry->name.data, entry->name.len + 1);
+
+	/* Get additional information about the file. */
+	if (ngx_de_info(scan->filename, dir) == NGX_FILE_ERROR) {
+		err = ngx_errno;
+
+		if (err != NGX_ENOENT && err != NGX_ELOOP) {
+			ngx_log_error(NGX_LOG_CRIT, scan->log, err,
+					ngx_de_info_n " \"%s\" failed", scan->filename);
+
+			if (err == NGX_EACCES) {
+				return NGX_DECLINED;
+			}
+
+			return ngx_http_responsiveindex_error(scan);
+		}
+
+		if (ngx_de_link_info(scan->filename, dir) == NGX_FILE_ERROR) {
+			ngx_log_error(NGX_LOG_CRIT, scan->log, ngx_errno,
+					ngx_de_link_info_n " \"%s\" failed",
+					scan->filename);
+			return ngx_http_responsiveindex_error(scan);
+		}
+	}
+
+	/*
+	 * The d_type is of whatever entry readdir returned last, and says
+	 * DT_LNK for a symlink; what counts is what the stat() found, as
+	 * with statx() through the ring.
+	 */
+	dir->type = 0;
+
+	entry->is_dir = ngx_de_is_dir(dir);
+	entry->mtime = ngx_de_mtime(dir);
+	entry->size = ngx_de_size(dir);
+	entry->uniq = ngx_file_uniq(&dir->info);
+	entry->dev = dir->info.st_dev;
+
+	return NGX_OK;
+}
+
+
+/*
+ * Submits the statx() calls for the entries read since the last batch,
+ * all at once and without waiting for them. Returns NGX_BUSY if they are
+ * in flight, NGX_OK if the entries are filled in already (the ring was
+ * full or has failed), or the HTTP status to fail with.
+ */
+static ngx_int_t
+ngx_http_responsiveindex_scan_stat(ngx_http_responsiveindex_scan_t *scan)
+{
+#if (NGX_HAVE_IO_URING_STATX)
+
+	u_char								*p;
+	size_t								size;
+	ngx_int_t							rc;
+	ngx_uint_t							i, n;
+	ngx_http_responsiveindex_entry_t	*entry;
+	ngx_http_responsiveindex_batch_t	*batch;
+
+	n = scan->listing.entries.nelts - scan->stated;
+
+	if (scan->uring == NULL || n == 0) {
+		return NGX_OK;
+	}
+
+	entry = (ngx_http_responsiveindex_entry_t *) scan->listing.entries.elts + scan->stated;
+
+	size = 0;
+
+	for (i = 0; i < n; i++) {
+		size += entry[i].name.len + 1;
+	}
+
+	/* The kernel may read the names after the pool is gone, so the batch has its own. */
+	batch = ngx_http_responsiveindex_uring_batch(n, size, scan->log);
+	if (batch == NULL) {
+		return ngx_http_responsiveindex_error(scan);
+	}
+
+	p = batch->names;
+
+	for (i = 0; i < n; i++) {
+		batch->sx[i].name = p;
+		p = ngx_cpymem(p, entry[i].name.data, entry[i].name.len + 1);
+	}
+
+	rc = ngx_http_responsiveindex_uring_submit(scan->uring, dirfd(scan->dir.dir), batch,
+			&scan->event, scan->log);
+
+	if (rc == NGX_OK) {
+		scan->stats = batch;
+		return NGX_BUSY;
+	}
+
+	ngx_http_responsiveindex_uring_free(batch);
+
+	if (rc == NGX_ERROR) {
+		/* The ring has failed, stat() this batch and the rest one by one. */
+		scan->uring = NULL;
+	}
+
+	return ngx_http_responsiveindex_scan_stated(scan, NULL);
+
+#else
+
+	return NGX_OK;
+
+#endif
+}
+
+
+#if (NGX_HAVE_IO_URING_STATX)
+
+/*
+ * Fills in the entries read since the last batch from its statx() calls,
+ * or all with stat() if batch is NULL. Anything the ring could not stat
+ * (a dangling symlink, an error) goes through
+ * ngx_http_responsiveindex_scan_info, so it is handled and logged the
+ * same as without the ring. Returns NGX_OK, or the HTTP status to fail
+ * with.
+ */
+static ngx_int_t
+ngx_http_responsiveindex_scan_stated(ngx_http_responsiveindex_scan_t *scan,
+		ngx_http_responsiveindex_batch_t *batch)
+{
+	ngx_int_t							rc;
+	ngx_uint_t							i, k, n;
+	ngx_http_responsiveindex_entry_t	*entry;
+	ngx_http_responsiveindex_statx_t	*sx;
+
+	n = scan->listing.entries.nelts - scan->stated;
+	entry = (ngx_http_responsiveindex_entry_t *) scan->listing.entries.elts + scan->stated;
+
+	for (i = 0, k = 0; i < n; i++) {
+		sx = batch ? &batch->sx[i] : NULL;
+
+		if (sx && sx->res == 0) {
+			entry[i].is_dir = S_ISDIR(sx->stx.stx_mode);
+			entry[i].mtime = sx->stx.stx_mtime.tv_sec;
+			entry[i].size = sx->stx.stx_size;
+			entry[i].uniq = sx->stx.stx_ino;
+			entry[i].dev = makedev(sx->stx.stx_dev_major, sx->stx.stx_dev_minor);
+
+		} else {
+			rc = ngx_http_responsiveindex_scan_info(scan, &entry[i]);
+
+			if (rc == NGX_DECLINED) {
+				continue;
+			}
+
+			if (rc != NGX_OK) {
+				return rc;
+			}
+		}
+
+		if (entry[i].dir_only && !entry[i].is_dir) {
+			continue;
+		}
+
+		if (k != i) {
+			entry[k] = entry[i];
+		}
+
+		k++;
+	}
+
+	scan->listing.entries.nelts = scan->stated + k;
+	scan->stated = scan->listing.entries.nelts;
+
+	return NGX_OK;
+}
+
+#endif
+
+
+#if (NGX_PCRE)
+
+/*
+ * Returns NGX_DECLINED if responsiveindex_exclude hides the name, NGX_AGAIN
+ * if responsiveindex_include does unless it is a directory (so that
+ * subdirectories can still be browsed), else NGX_OK.
+ */
+static ngx_int_t
+ngx_http_responsiveindex_filtered(ngx_http_responsiveindex_scan_t *scan, ngx_str_t *name)
+{
+	ngx_int_t  n;
+
+	if (scan->exclude) {
+		n = ngx_regex_exec(scan->exclude, name, NULL, 0);
+
+		if (n != NGX_REGEX_NO_MATCHED) {
+			if (n < 0) {
+				ngx_log_error(NGX_LOG_ALERT, scan->log, 0,
+						ngx_regex_exec_n " failed: %i on \"%V\"", n, name);
+			}
+
+			return NGX_DECLINED;
+		}
+	}
+
+	if (scan->include) {
+		n = ngx_regex_exec(scan->include, name, NULL, 0);
+
+		if (n == NGX_REGEX_NO_MATCHED) {
+			return NGX_AGAIN;
+		}
+
+		if (n < 0) {
+			ngx_log_error(NGX_LOG_ALERT, scan->log, 0,
+					ngx_regex_exec_n " failed: %i on \"%V\"", n, name);
+			return NGX_DECLINED;
+		}
+	}
+
+	return NGX_OK;
+}
+
+#endif
+
+
+static void
+ngx_http_responsiveindex_scan_handler(ngx_event_t *ev)
+{
+	ngx_int_t							rc;
+	ngx_http_responsiveindex_scan_t		*scan;
+
+	scan = ev->data;
+
+	rc = ngx_http_responsiveindex_scan_step(scan);
+
+	if (rc == NGX_AGAIN) {
+		/* A zero timer lets the event loop poll for I/O before the next slice. */
+		ngx_add_timer(ev, 0);
+		return;
+	}
+
+	if (rc == NGX_BUSY) {
+		return;
+	}
+
+	scan->done(scan, rc);
+}
+
+
+/* Releases what a scan holds if its pool goes away before the read is done. */
+static void
+ngx_http_responsiveindex_scan_cleanup(void *data)
+{
+	ngx_http_responsiveindex_scan_t  *scan = data;
+
+	if (scan->event.timer_set) {
+		ngx_del_timer(&scan->event);
+	}
+
+	if (scan->event.posted) {
+		ngx_delete_posted_event(&scan->event);
+	}
+
+#if (NGX_HAVE_IO_URING_STATX)
+
+	/*
+	 * What is still in flight is freed once the kernel is done with it,
+	 * with the dup() of the directory it holds, so closing ours is safe.
+	 */
+	if (scan->stats) {
+		ngx_http_responsiveindex_uring_free(scan->stats);
+		scan->stats = NULL;
+	}
+
+#endif
+
+	if (scan->opened) {
+		scan->opened = 0;
+
+		if (ngx_close_dir(&scan->dir) == NGX_ERROR) {
+			ngx_log_error(NGX_LOG_ALERT, scan->log, ngx_errno,
+					ngx_close_dir_n " \"%V\" failed", &scan->path);
+		}
+	}
+}
+
+
+/*
+ * Renders the listing as JSON for polling clients: "time" is the value to
+ * pass as ?since next, and "deleted" is only there if the cache knows.
+ *
+ * {"time":1700000000,"entries":[{"name":"a","type":"directory","mtime":1699999000},
+ *   {"name":"b","type":"file","mtime":1699999999,"size":42}],"deleted":["c"]}
+ *
+ * A directory has "size" and "files" too once the totals of its tree are known.
+ */
+static ngx_buf_t *
+ngx_http_responsiveindex_json(ngx_http_request_t *r,
+		ngx_http_responsiveindex_listing_t *listing)
+{
+	size_t								len;
+	ngx_buf_t							*b;
+	ngx_uint_t							i;
+	ngx_http_responsiveindex_entry_t	*entry;
+	ngx_http_responsiveindex_deleted_t	*deleted;
+
+	len = sizeof("{\"time\":,\"entries\":[]}") - 1 + NGX_TIME_T_LEN;
+
+	entry = listing->entries.elts;
+
+	for (i = 0; i < listing->entries.nelts; i++) {
+		entry[i].escape = ngx_escape_json(NULL, entry[i].name.data, entry[i].name.len);
+
+		len += sizeof("{\"name\":\"\",\"type\":\"directory\",\"mtime\":,\"size\":,\"files\":},")
+			- 1 + entry[i].name.len + entry[i].escape
+			+ NGX_TIME_T_LEN + NGX_OFF_T_LEN + NGX_INT_T_LEN;
+	}
+
+	deleted = NULL;
+
+	if (listing->deleted) {
+		deleted = listing->deleted->elts;
+
+		len += sizeof(",\"deleted\":[]") - 1;
+
+		for (i = 0; i < listing->deleted->nelts; i++) {
+			len += sizeof("\"\",") - 1 + deleted[i].name.len
+				+ ngx_escape_json(NULL, deleted[i].name.data, deleted[i].name.len);
+		}
+	}
+
+	b = ngx_create_temp_buf(r->pool, len);
+	if (b == NULL) {
+		return NULL;
+	}
+
+	b->last = ngx_sprintf(b->last, "{\"time\":%T,\"entries\":[", listing->scanned - 1);
+
+	for (i = 0; i < listing->entries.nelts; i++) {
+		if (i) {
+			*b->last++ = ',';
+		}
+
+		b->last = ngx_cpymem(b->last, "{\"name\":\"", sizeof("{\"name\":\"") - 1);
+
+		if (entry[i].escape) {
+			b->last = (u_char *) ngx_escape_json(b->last, entry[i].name.data,
+					entry[i].name.len);
+
+		} else {
+			b->last = ngx_cpymem(b->last, entry[i].name.data, entry[i].name.len);
+		}
+
+		if (entry[i].sized) {
+			b->last = ngx_sprintf(b->last,
+					"\",\"type\":\"directory\",\"mtime\":%T,\"size\":%O,\"files\":%ui}",
+					entry[i].mtime, entry[i].size, entry[i].files);
+
+		} else if (entry[i].is_dir) {
+			b->last = ngx_sprintf(b->last, "\",\"type\":\"directory\",\"mtime\":%T}",
+					entry[i].mtime);
+
+		} else {
+			b->last = ngx_sprintf(b->last, "\",\"type\":\"file\",\"mtime\":%T,\"size\":%O}",
+					entry[i].mtime, entry[i].size);
+		}
+	}
+
+	*b->last++ = ']';
+
+	if (deleted) {
+		b->last = ngx_cpymem(b->last, ",\"deleted\":[", sizeof(",\"deleted\":[") - 1);
+
+		for (i = 0; i < listing->deleted->nelts; i++) {
+			if (i) {
+				*b->last++ = ',';
+			}
+
+			*b->last++ = '"';
+			b->last = (u_char *) ngx_escape_json(b->last, deleted[i].name.data,
+					deleted[i].name.len);
+			*b->last++ = '"';
+		}
+
+		*b->last++ = ']';
+	}
+
+	*b->last++ = '}';
+
+	return b;
+}
+
+
+/*
+ * Renders the listing as one JSON value per line, for the virtual layout's
+ * script to parse as it arrives: a {"time":...} line, then an array per
+ * entry, ["name",1,mtime] for a directory (["name",1,mtime,size,files]
+ * once the totals of its tree are known) and ["name",0,mtime,size] for a
+ * file, then a {"deleted":[...]} line if ?since was given and it is known.
+ */
+static ngx_buf_t *
+ngx_http_responsiveindex_ndjson(ngx_http_request_t *r,
+		ngx_http_responsiveindex_listing_t *listing)
+{
+	size_t								len;
+	ngx_buf_t							*b;
+	ngx_uint_t							i;
+	ngx_http_responsiveindex_entry_t	*entry;
+	ngx_http_responsiveindex_deleted_t	*deleted;
+
+	len = sizeof("{\"time\":}\n") - 1 + NGX_TIME_T_LEN;
+
+	entry = listing->entries.elts;
+
+	for (i = 0; i < listing->entries.nelts; i++) {
+		entry[i].escape = ngx_escape_json(NULL, entry[i].name.data, entry[i].name.len);
+
+		len += sizeof("[\"\",0,,,]\n") - 1
+			+ entry[i].name.len + entry[i].escape
+			+ NGX_TIME_T_LEN + NGX_OFF_T_LEN + NGX_INT_T_LEN;
+	}
+
+	deleted = NULL;
+
+	if (listing->deleted) {
+		deleted = listing->deleted->elts;
+
+		len += sizeof("{\"deleted\":[]}\n") - 1;
+
+		for (i = 0; i < listing->deleted->nelts; i++) {
+			len += sizeof("\"\",") - 1 + deleted[i].name.len
+				+ ngx_escape_json(NULL, deleted[i].name.data, deleted[i].name.len);
+		}
+	}
+
+	b = ngx_create_temp_buf(r->pool, len);
+	if (b == NULL) {
+		return NULL;
+	}
+
+	b->last = ngx_sprintf(b->last, "{\"time\":%T}\n", listing->scanned - 1);
+
+	for (i = 0; i < listing->entries.nelts; i++) {
+		*b->last++ = '[';
+		*b->last++ = '"';
+
+		if (entry[i].escape) {
+			b->last = (u_char *) ngx_escape_json(b->last, entry[i].name.data,
+					entry[i].name.len);
+
+		} else {
+			b->last = ngx_cpymem(b->last, entry[i].name.data, entry[i].name.len);
+		}
+
+		if (entry[i].sized) {
+			b->last = ngx_sprintf(b->last, "\",1,%T,%O,%ui]\n", entry[i].mtime,
+					entry[i].size, entry[i].files);
+
+		} else if (entry[i].is_dir) {
+			b->last = ngx_sprintf(b->last, "\",1,%T]\n", entry[i].mtime);
+
+		} else {
+			b->last = ngx_sprintf(b->last, "\",0,%T,%O]\n", entry[i].mtime, entry[i].size);
+		}
+	}
+
+	if (deleted) {
+		b->last = ngx_cpymem(b->last, "{\"deleted\":[", sizeof("{\"deleted\":[") - 1);
+
+		for (i = 0; i < listing->deleted->nelts; i++) {
+			if (i) {
+				*b->last++ = ',';
+			}
+
+			*b->last++ = '"';
+			b->last = (u_char *) ngx_escape_json(b->last, deleted[i].name.data,
+					deleted[i].name.len);
+			*b->last++ = '"';
+		}
+
+		*b->last++ = ']';
+		*b->last++ = '}';
+		*b->last++ = LF;
+	}
+
+	return b;
+}
+
+
+/*
+ * The page of the virtual layout. It is the same for any directory but
+ * for its heading, so it costs nothing however big the directory is; the
+ * script then fetches the entries with ?format=ndjson.
+ */
+static ngx_buf_t *
+ngx_http_responsiveindex_shell(ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf)
+{
+	size_t						escape_html, response_size;
+	ngx_buf_t					*b;
+
+	escape_html = ngx_escape_html(NULL, r->uri.data, r->uri.len);
+
+	response_size = r->uri.len + escape_html
+		+ r->uri.len + escape_html
+		+ to_lang.len
+		+ (conf->lang.len ? conf->lang.len : en.len)
+		+ to_stylesheet.len
+		+ virtual_style.len
+		+ to_title.len
+		+ to_h1.len
+		+ to_virtual_exact.len + 1
+		+ to_virtual_local.len + 1
+		+ to_virtual_end.len
+		;
+
+	if (conf->bootstrap_href.len) {
+		response_size += link_pre_href.len + conf->bootstrap_href.len + link_post_href.len;
+	} else {
+		response_size += inline_stylesheet.len;
+	}
+
+	b = ngx_create_temp_buf(r->pool, response_size);
+	if (b == NULL) {
+		return NULL;
+	}
+
+	b->last = ngx_cpymem(b->last, to_lang.data, to_lang.len);
+
+	if (conf->lang.len) {
+		b->last = ngx_cpymem(b->last, conf->lang.data, conf->lang.len);
+	} else {
+		b->last = ngx_cpymem(b->last, en.data, en.len);
+	}
+
+	b->last = ngx_cpymem(b->last, to_stylesheet.data, to_stylesheet.len);
+
+	if (conf->bootstrap_href.len) {
+		b->last = ngx_cpymem(b->last, link_pre_href.data, link_pre_href.len);
+		b->last = ngx_cpymem(b->last, conf->bootstrap_href.data, conf->bootstrap_href.len);
+		b->last = ngx_cpymem(b->last, link_post_href.data, link_post_href.len);
+	} else {
+		b->last = ngx_cpymem(b->last, inline_stylesheet.data, inline_stylesheet.len);
+	}
+
+	b->last = ngx_cpymem(b->last, virtual_style.data, virtual_style.len);
+	b->last = ngx_cpymem(b->last, to_title.data, to_title.len);
+
+	if (escape_html) {
+		b->last = (u_char *) ngx_escape_html(b->last, r->uri.data, r->uri.len);
+		b->last = ngx_cpymem(b->last, to_h1.data, to_h1.len);
+		b->last = (u_char *) ngx_escape_html(b->last, r->uri.data, r->uri.len);
+	} else {
+		b->last = ngx_cpymem(b->last, r->uri.data, r->uri.len);
+		b->last = ngx_cpymem(b->last, to_h1.data, to_h1.len);
+		b->last = ngx_cpymem(b->last, r->uri.data, r->uri.len);
+	}
+
+	/* The script formats sizes and dates the same way the table does. */
+
+	b->last = ngx_cpymem(b->last, to_virtual_exact.data, to_virtual_exact.len);
+	*b->last++ = conf->exact_size ? '1' : '0';
+	b->last = ngx_cpymem(b->last, to_virtual_local.data, to_virtual_local.len);
+	*b->last++ = conf->localtime ? '1' : '0';
+	b->last = ngx_cpymem(b->last, to_virtual_end.data, to_virtual_end.len);
+
+	return b;
+}
+
+
+/*
+ * Starts sending the listed files as a tar or zip archive. The headers are
+ * already out; the rest goes from the write event handler, and the request
+ * is finalized from there once the archive is complete.
+ */
+static ngx_int_t
+ngx_http_responsiveindex_archive(ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf,
+		ngx_http_responsiveindex_listing_t *listing, ngx_uint_t format)
+{
+	u_char								*last;
+	size_t								root;
+	ngx_str_t							name;
+	ngx_pool_cleanup_t					*cln;
+	ngx_http_responsiveindex_archive_t	*ar;
+
+	ar = ngx_pcalloc(r->pool, sizeof(ngx_http_responsiveindex_archive_t));
+	if (ar == NULL) {
+		return NGX_ERROR;
+	}
+
+	ar->request = r;
+	ar->conf = conf;
+	ar->entries = &listing->entries;
+	ar->zip = (format == NGX_HTTP_RESPONSIVEINDEX_FORMAT_ZIP);
+
+	last = ngx_http_map_uri_to_path(r, &ar->path, &root, 0);
+	if (last == NULL) {
+		return NGX_ERROR;
+	}
+
+	ar->path.len = last - ar->path.data;
+	if (ar->path.len > 1) {
+		ar->path.len--;
+	}
+
+	/* Everything goes in a directory named like the one listed. */
+
+	if (ngx_http_responsiveindex_archive_name(r, &name) != NGX_OK) {
+		return NGX_ERROR;
+	}
+
+	ar->prefix.len = name.len + 1;
+	ar->prefix.data = ngx_pnalloc(r->pool, ar->prefix.len);
+	if (ar->prefix.data == NULL) {
+		return NGX_ERROR;
+	}
+
+	last = ngx_cpymem(ar->prefix.data, name.data, name.len);
+	*last = '/';
+
+	if (ar->zip) {
+		ar->files = ngx_array_create(r->pool, 16,
+				sizeof(ngx_http_responsiveindex_zip_entry_t));
+		if (ar->files == NULL) {
+			return NGX_ERROR;
+		}
+
+		ar->crc_buf = ngx_palloc(r->pool, NGX_HTTP_RESPONSIVEINDEX_ARCHIVE_READ);
+		if (ar->crc_buf == NULL) {
+			return NGX_ERROR;
+		}
+	}
+
+	cln = ngx_pool_cleanup_add(r->pool, 0);
+	if (cln == NULL) {
+		return NGX_ERROR;
+	}
+
+	cln->handler = ngx_http_responsiveindex_archive_cleanup;
+	cln->data = ar;
+
+	ngx_http_set_ctx(r, ar, ngx_http_responsiveindex_module);
+
+	r->write_event_handler = ngx_http_responsiveindex_archive_handler;
+	r->main->count++;
+
+	ngx_http_responsiveindex_archive_send(ar);
+
+	return NGX_DONE;
+}
+
+
+/* The name of the listed directory ("index" for the root), fit for a Content-Disposition. */
+static ngx_int_t
+ngx_http_responsiveindex_archive_name(ngx_http_request_t *r, ngx_str_t *name)
+{
+	u_char  *p, *start, *end;
+
+	/* Leave out the trailing slash. */
+	end = r->uri.data + r->uri.len - 1;
+
+	for (start = end; start > r->uri.data && start[-1] != '/'; start--) {
+		/* void */
+	}
+
+	if (start == end) {
+		ngx_str_set(name, "index");
+		return NGX_OK;
+	}
+
+	name->len = end - start;
+	name->data = ngx_pnalloc(r->pool, name->len);
+	if (name->data == NULL) {
+		return NGX_ERROR;
+	}
+
+	for (p = name->data; start < end; start++) {
+		*p++ = (*start < 0x20 || *start == 0x7f || *start == '"' || *start == '\\')
+			? '_' : *start;
+	}
+
+	return NGX_OK;
+}
+
+
+static void
+ngx_http_responsiveindex_archive_handler(ngx_http_request_t *r)
+{
+	ngx_event_t							*wev;
+	ngx_http_responsiveindex_archive_t	*ar;
+
+	wev = r->connection->write;
+
+	if (wev->timedout) {
+		ngx_log_error(NGX_LOG_INFO, r->connection->log, NGX_ETIMEDOUT,
+				"client timed out");
+		r->connection->timedout = 1;
+		ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+		return;
+	}
+
+	ar = ngx_http_get_module_ctx(r, ngx_http_responsiveindex_module);
+
+	ngx_http_responsiveindex_archive_send(ar);
+}
+
+
+/*
+ * Sends batches of files until the client cannot take more, then waits for
+ * the write event. A batch's files are closed only once all of it is sent.
+ */
+static void
+ngx_http_responsiveindex_archive_send(ngx_http_responsiveindex_archive_t *ar)
+{
+	ngx_int_t					rc;
+	ngx_event_t					*wev;
+	ngx_connection_t			*c;
+	ngx_http_request_t			*r;
+	ngx_http_core_loc_conf_t	*clcf;
+
+	r = ar->request;
+	c = r->connection;
+	wev = c->write;
+
+	/* The thread working out the checksums carries on from its event. */
+	if (ar->summing) {
+		return;
+	}
+
+	for ( ;; ) {
+
+		if (ar->pool) {
+			rc = ngx_http_output_filter(r, ar->out);
+			ar->out = NULL;
+
+			if (rc == NGX_ERROR) {
+				ngx_http_finalize_request(r, NGX_ERROR);
+				return;
+			}
+
+			/*
+			 * The files may still be referred to by buffers a filter holds
+			 * on to, or be read by an aio thread, until all of this is clear,
+			 * as in ngx_http_writer().
+			 */
+			if (rc != NGX_OK
+				|| r->out || r->buffered || r->aio || r->postponed || c->buffered)
+			{
+				break;
+			}
+
+			ngx_destroy_pool(ar->pool);
+			ar->pool = NULL;
+		}
+
+		if (ar->done) {
+			if (wev->timer_set) {
+				ngx_del_timer(wev);
+			}
+
+			ngx_http_finalize_request(r, NGX_OK);
+			return;
+		}
+
+		rc = ngx_http_responsiveindex_archive_batch(ar);
+
+		if (rc == NGX_ERROR) {
+			ngx_http_finalize_request(r, NGX_ERROR);
+			return;
+		}
+
+		if (rc == NGX_AGAIN) {
+			/* Nothing is being sent meanwhile. */
+			if (wev->timer_set) {
+				ngx_del_timer(wev);
+			}
+
+			return;
+		}
+	}
+
+	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+	if (!wev->delayed) {
+		ngx_add_timer(wev, clcf->send_timeout);
+	}
+
+	if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+		ngx_http_finalize_request(r, NGX_ERROR);
+	}
+}
+
+
+/*
+ * Opens the next files and chains them up, after the end of the archive if
+ * none are left. Returns NGX_AGAIN if their checksums are left to a thread,
+ * which sends them once done.
+ */
+static ngx_int_t
+ngx_http_responsiveindex_archive_batch(ngx_http_responsiveindex_archive_t *ar)
+{
+	off_t								end;
+	ngx_int_t							rc;
+	ngx_http_responsiveindex_entry_t	*entry;
+#if (NGX_THREADS)
+	ngx_thread_task_t					*task;
+#endif
+
+	ar->pool = ngx_create_pool(4096, ar->request->connection->log);
+	if (ar->pool == NULL) {
+		return NGX_ERROR;
+	}
+
+	ar->out = NULL;
+	ar->last = &ar->out;
+
+	ar->open = ngx_palloc(ar->pool, NGX_HTTP_RESPONSIVEINDEX_ARCHIVE_BATCH
+			* sizeof(ngx_http_responsiveindex_archive_file_t));
+	if (ar->open == NULL) {
+		return NGX_ERROR;
+	}
+
+	ar->nopen = 0;
+
+	entry = ar->entries->elts;
+
+	/* Where the archive ends with the files opened so far. */
+	end = ar->offset;
+
+	while (ar->nopen < NGX_HTTP_RESPONSIVEINDEX_ARCHIVE_BATCH
+		   && ar->next < ar->entries->nelts)
+	{
+		/* Only the files of the directory itself. */
+		if (entry[ar->next].is_dir) {
+			ar->next++;
+			continue;
+		}
+
+		rc = ngx_http_responsiveindex_archive_open(ar, &entry[ar->next], &end);
+
+		if (rc == NGX_ERROR) {
+			return NGX_ERROR;
+		}
+
+		if (rc == NGX_DONE) {
+			/* The zip archive is full, whatever else there is stays out. */
+			ar->next = ar->entries->nelts;
+			break;
+		}
+
+		ar->next++;
+	}
+
+#if (NGX_THREADS)
+
+	if (ar->zip && ar->nopen) {
+		task = ngx_thread_task_alloc(ar->pool, 0);
+		if (task == NULL) {
+			return NGX_ERROR;
+		}
+
+		task->ctx = ar;
+		task->handler = ngx_http_responsiveindex_archive_crc_thread;
+		task->event.handler = ngx_http_responsiveindex_archive_crc_done;
+		task->event.data = ar;
+
+		if (ngx_thread_task_post(ar->conf->archive_pool, task) != NGX_OK) {
+			return NGX_ERROR;
+		}
+
+		ar->summing = 1;
+		ar->request->main->blocked++;
+
+		return NGX_AGAIN;
+	}
+
+#endif
+
+	return ngx_http_responsiveindex_archive_chain(ar);
+}
+
+
+/*
+ * Opens a file for the batch. The size and date are those of the open
+ * file, so the header matches what is sent even if the listing is a bit
+ * old. Returns NGX_OK, NGX_DECLINED for a file to leave out (closed right
+ * away), NGX_DONE once a zip archive cannot take any more, or NGX_ERROR.
+ */
+static ngx_int_t
+ngx_http_responsiveindex_archive_open(ngx_http_responsiveindex_archive_t *ar,
+		ngx_http_responsiveindex_entry_t *entry, off_t *end)
+{
+	u_char									*p;
+	off_t									room;
+	ngx_str_t								path;
+	ngx_connection_t						*c;
+	ngx_http_request_t						*r;
+	ngx_open_file_info_t					of;
+	ngx_http_core_loc_conf_t				*clcf;
+	ngx_http_responsiveindex_archive_file_t	*af;
+
+	r = ar->request;
+	c = r->connection;
+
+	/* There is no zip64 support, so sizes and offsets must fit 32 bits. */
+
+	room = 0;
+
+	if (ar->zip) {
+		room = (off_t) 0xffffffff - *end - NGX_HTTP_RESPONSIVEINDEX_ZIP_LOCAL
+			- (off_t) (ar->prefix.len + entry->name.len);
+
+		if (ar->files->nelts + ar->nopen == 0xffff || room <= 0) {
+			ngx_log_error(NGX_LOG_WARN, c->log, 0,
+					"responsiveindex: zip archive of \"%V\" is full, "
+					"the remaining files are left out", &ar->path);
+			return NGX_DONE;
+		}
+
+		/* Going by the listing, a file too big is not even opened. */
+		if (entry->size >= room) {
+			ngx_log_error(NGX_LOG_WARN, c->log, 0,
+					"responsiveindex: \"%V/%V\" left out of zip archive, "
+					"which would be too big", &ar->path, &entry->name);
+			return NGX_DECLINED;
+		}
+	}
+
+	path.len = ar->path.len + 1 + entry->name.len;
+	path.data = ngx_pnalloc(ar->pool, path.len + 1);
+	if (path.data == NULL) {
+		return NGX_ERROR;
+	}
+
+	p = ngx_cpymem(path.data, ar->path.data, ar->path.len);
+	*p++ = '/';
+	ngx_cpystrn(p, entry->name.data, entry->name.len + 1);
+
+	/* As ngx_http_static_module does, so disable_symlinks and open_file_cache apply. */
+
+	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+	ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+
+	of.read_ahead = clcf->read_ahead;
+	of.valid = clcf->open_file_cache_valid;
+	of.min_uses = clcf->open_file_cache_min_uses;
+	of.errors = clcf->open_file_cache_errors;
+	of.events = clcf->open_file_cache_events;
+
+	/* Zip checksums are read into plain buffers. */
+	of.directio = NGX_OPEN_FILE_DIRECTIO_OFF;
+
+	if (ngx_http_set_disable_symlinks(r, clcf, &path, &of) != NGX_OK) {
+		return NGX_ERROR;
+	}
+
+	/* The file is opened non-blocking, so a FIFO cannot hang the worker. */
+	if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, ar->pool) != NGX_OK) {
+		ngx_log_error(NGX_LOG_ERR, c->log, of.err,
+				"%s \"%s\" failed", of.failed, path.data);
+		return NGX_DECLINED;
+	}
+
+	/*
+	 * A file left out is closed at once, so open files stay bounded by the
+	 * batch. One from open_file_cache belongs to the cache, which bounds them.
+	 */
+
+	if (!of.is_file) {
+		ngx_pool_run_cleanup_file(ar->pool, of.fd);
+		return NGX_DECLINED;
+	}
+
+	if (ar->zip && of.size >= room) {
+		ngx_log_error(NGX_LOG_WARN, c->log, 0,
+				"responsiveindex: \"%s\" left out of zip archive, "
+				"which would be too big", path.data);
+		ngx_pool_run_cleanup_file(ar->pool, of.fd);
+		return NGX_DECLINED;
+	}
+
+	af = &ar->open[ar->nopen++];
+
+	ngx_memzero(af, sizeof(ngx_http_responsiveindex_archive_file_t));
+
+	af->entry = entry;
+	af->size = of.size;
+	af->mtime = of.mtime;
+	af->rc = NGX_OK;
+
+	af->file.fd = of.fd;
+	af->file.name = path;
+	af->file.log = c->log;
+
+	*end += NGX_HTTP_RESPONSIVEINDEX_ZIP_LOCAL + ar->prefix.len + entry->name.len + of.size;
+
+	return NGX_OK;
+}
+
+
+/*
+ * Chains up the files of the batch, and the end of the archive if none are
+ * left. A file changed since it was opened, e.g. while its checksum was
+ * worked out, would not match its header, so that aborts the archive.
+ */
+static ngx_int_t
+ngx_http_responsiveindex_archive_chain(ngx_http_responsiveindex_archive_t *ar)
+{
+	ngx_uint_t								i;
+	ngx_file_info_t							fi;
+	ngx_http_responsiveindex_archive_file_t	*af;
+
+	for (i = 0; i < ar->nopen; i++) {
+		af = &ar->open[i];
+
+		if (af->rc != NGX_OK) {
+			ngx_pool_run_cleanup_file(ar->pool, af->file.fd);
+			continue;
+		}
+
+		if (ngx_fd_info(af->file.fd, &fi) == NGX_FILE_ERROR) {
+			ngx_log_error(NGX_LOG_CRIT, af->file.log, ngx_errno,
+					ngx_fd_info_n " \"%s\" failed", af->file.name.data);
+			return NGX_ERROR;
+		}
+
+		if (ngx_file_size(&fi) != af->size || ngx_file_mtime(&fi) != af->mtime) {
+			ngx_log_error(NGX_LOG_ERR, af->file.log, 0,
+					"responsiveindex: \"%s\" changed while being archived",
+					af->file.name.data);
+			return NGX_ERROR;
+		}
+
+		if (ngx_http_responsiveindex_archive_file(ar, af) != NGX_OK) {
+			return NGX_ERROR;
+		}
+	}
+
+	if (ar->next == ar->entries->nelts) {
+		if (ngx_http_responsiveindex_archive_end(ar) != NGX_OK) {
+			return NGX_ERROR;
+		}
+
+		ar->done = 1;
+	}
+
+	return NGX_OK;
+}
+
+
+/* Chains up a file: its header, then its contents as an in_file buffer for sendfile. */
+static ngx_int_t
+ngx_http_responsiveindex_archive_file(ngx_http_responsiveindex_archive_t *ar,
+		ngx_http_responsiveindex_archive_file_t *af)
+{
+	u_char									*p;
+	off_t									size, pad;
+	size_t									len;
+	ngx_tm_t								tm;
+	ngx_buf_t								*b;
+	ngx_time_t								*tp;
+	ngx_http_responsiveindex_entry_t		*entry;
+	ngx_http_responsiveindex_zip_entry_t	*ze;
+
+	static ngx_str_t  longlink = ngx_string("././@LongLink");
+	static ngx_str_t  none = ngx_string("");
+
+	entry = af->entry;
+	size = af->size;
+	len = ar->prefix.len + entry->name.len;
+
+	if (ar->zip) {
+		ze = ngx_array_push(ar->files);
+		if (ze == NULL) {
+			return NGX_ERROR;
+		}
+
+		ze->name = entry->name;
+		ze->crc = af->crc;
+		ze->size = (uint32_t) size;
+		ze->offset = (uint32_t) ar->offset;
+
+		tp = ngx_timeofday();
+		ngx_gmtime(af->mtime + tp->gmtoff * 60 * ar->conf->localtime, &tm);
+
+		if (tm.ngx_tm_year < 1980) {
+			ze->time = 0;
+			ze->date = (1 << 5) | 1;
+
+		} else {
+			ze->time = (tm.ngx_tm_hour << 11) | (tm.ngx_tm_min << 5) | (tm.ngx_tm_sec >> 1);
+			ze->date = ((tm.ngx_tm_year - 1980) << 9) | (tm.ngx_tm_mon << 5)
+				| tm.ngx_tm_mday;
+		}
+
+		b = ngx_create_temp_buf(ar->pool, NGX_HTTP_RESPONSIVEINDEX_ZIP_LOCAL + len);
+		if (b == NULL) {
+			return NGX_ERROR;
+		}
+
+		p = b->last;
+
+		p = ngx_http_responsiveindex_put32(p, 0x04034b50);
+
+		/* Version 1.0, UTF-8 names, stored. */
+		p = ngx_http_responsiveindex_put16(p, 10);
+		p = ngx_http_responsiveindex_put16(p, 0x0800);
+		p = ngx_http_responsiveindex_put16(p, 0);
+
+		p = ngx_http_responsiveindex_put16(p, ze->time);
+		p = ngx_http_responsiveindex_put16(p, ze->date);
+		p = ngx_http_responsiveindex_put32(p, ze->crc);
+		p = ngx_http_responsiveindex_put32(p, ze->size);
+		p = ngx_http_responsiveindex_put32(p, ze->size);
+		p = ngx_http_responsiveindex_put16(p, len);
+		p = ngx_http_responsiveindex_put16(p, 0);
+
+		p = ngx_cpymem(p, ar->prefix.data, ar->prefix.len);
+		b->last = ngx_cpymem(p, entry->name.data, entry->name.len);
+
+		pad = 0;
+
+	} else {
+		b = ngx_create_temp_buf(ar->pool, NGX_HTTP_RESPONSIVEINDEX_TAR_BLOCK
+				+ (len > 100 ? NGX_HTTP_RESPONSIVEINDEX_TAR_BLOCK
+							   + ngx_align(len + 1, NGX_HTTP_RESPONSIVEINDEX_TAR_BLOCK)
+							 : 0));
+		if (b == NULL) {
+			return NGX_ERROR;
+		}
+
+		p = b->last;
+
+		/* Names over 100 bytes come whole in a GNU long name entry first. */
+		if (len > 100) {
+			p = ngx_http_responsiveindex_tar_header(p, &none, &longlink, 'L', len + 1, 0);
+
+			ngx_memzero(p, ngx_align(len + 1, NGX_HTTP_RESPONSIVEINDEX_TAR_BLOCK));
+			ngx_memcpy(p, ar->prefix.data, ar->prefix.len);
+			ngx_memcpy(p + ar->prefix.len, entry->name.data, entry->name.len);
+
+			p += ngx_align(len + 1, NGX_HTTP_RESPONSIVEINDEX_TAR_BLOCK);
+		}
+
+		b->last = ngx_http_responsiveindex_tar_header(p, &ar->prefix, &entry->name, '0',
+				size, af->mtime);
+
+		pad = size % NGX_HTTP_RESPONSIVEINDEX_TAR_BLOCK;
+
+		if (pad) {
+			pad = NGX_HTTP_RESPONSIVEINDEX_TAR_BLOCK - pad;
+		}
+	}
+
+	if (ngx_http_responsiveindex_archive_link(ar, b) != NGX_OK) {
+		return NGX_ERROR;
+	}
+
+	ar->offset += b->last - b->pos;
+
+	if (size) {
+		b = ngx_calloc_buf(ar->pool);
+		if (b == NULL) {
+			return NGX_ERROR;
+		}
+
+		b->file = &af->file;
+
+		b->in_file = 1;
+		b->file_pos = 0;
+		b->file_last = size;
+
+		if (ngx_http_responsiveindex_archive_link(ar, b) != NGX_OK) {
+			return NGX_ERROR;
+		}
+
+		ar->offset += size;
+	}
+
+	if (pad) {
+		b = ngx_calloc_buf(ar->pool);
+		if (b == NULL) {
+			return NGX_ERROR;
+		}
+
+		b->pos = ngx_http_responsiveindex_zeros;
+		b->last = ngx_http_responsiveindex_zeros + pad;
+		b->memory = 1;
+
+		if (ngx_http_responsiveindex_archive_link(ar, b) != NGX_OK) {
+			return NGX_ERROR;
+		}
+
+		ar->offset += pad;
+	}
+
+	return NGX_OK;
+}
+
+
+/* Chains up the end of the archive: two empty blocks for tar, the central directory for zip. */
+static ngx_int_t
+ngx_http_responsiveindex_archive_end(ngx_http_responsiveindex_archive_t *ar)
+{
+	u_char									*p;
+	size_t									len;
+	ngx_buf_t								*b;
+	ngx_uint_t								i;
+	ngx_http_responsiveindex_zip_entry_t	*ze;
+
+	if (!ar->zip) {
+		b = ngx_calloc_buf(ar->pool);
+		if (b == NULL) {
+			return NGX_ERROR;
+		}
+
+		b->pos = ngx_http_responsiveindex_zeros;
+		b->last = ngx_http_responsiveindex_zeros + sizeof(ngx_http_responsiveindex_zeros);
+		b->memory = 1;
+
+	} else {
+		ze = ar->files->elts;
+		len = 0;
+
+		for (i = 0; i < ar->files->nelts; i++) {
+			len += NGX_HTTP_RESPONSIVEINDEX_ZIP_CENTRAL + ar->prefix.len + ze[i].name.len;
+		}
+
+		b = ngx_create_temp_buf(ar->pool, len + NGX_HTTP_RESPONSIVEINDEX_ZIP_END);
+		if (b == NULL) {
+			return NGX_ERROR;
+		}
+
+		p = b->last;
+
+		for (i = 0; i < ar->files->nelts; i++) {
+			p = ngx_http_responsiveindex_put32(p, 0x02014b50);
+
+			/* Made by Unix, version 2.0; needs 1.0, UTF-8 names, stored. */
+			p = ngx_http_responsiveindex_put16(p, (3 << 8) | 20);
+			p = ngx_http_responsiveindex_put16(p, 10);
+			p = ngx_http_responsiveindex_put16(p, 0x0800);
+			p = ngx_http_responsiveindex_put16(p, 0);
+
+			p = ngx_http_responsiveindex_put16(p, ze[i].time);
+			p = ngx_http_responsiveindex_put16(p, ze[i].date);
+			p = ngx_http_responsiveindex_put32(p, ze[i].crc);
+			p = ngx_http_responsiveindex_put32(p, ze[i].size);
+			p = ngx_http_responsiveindex_put32(p, ze[i].size);
+			p = ngx_http_responsiveindex_put16(p, ar->prefix.len + ze[i].name.len);
+
+			/* No extra field or comment, disk 0, binary. */
+			p = ngx_http_responsiveindex_put16(p, 0);
+			p = ngx_http_responsiveindex_put16(p, 0);
+			p = ngx_http_responsiveindex_put16(p, 0);
+			p = ngx_http_responsiveindex_put16(p, 0);
+
+			/* A regular file, rw-r--r--. */
+			p = ngx_http_responsiveindex_put32(p, 0100644 << 16);
+			p = ngx_http_responsiveindex_put32(p, ze[i].offset);
+
+			p = ngx_cpymem(p, ar->prefix.data, ar->prefix.len);
+			p = ngx_cpymem(p, ze[i].name.data, ze[i].name.len);
+		}
+
+		p = ngx_http_responsiveindex_put32(p, 0x06054b50);
+		p = ngx_http_responsiveindex_put16(p, 0);
+		p = ngx_http_responsiveindex_put16(p, 0);
+		p = ngx_http_responsiveindex_put16(p, ar->files->nelts);
+		p = ngx_http_responsiveindex_put16(p, ar->files->nelts);
+		p = ngx_http_responsiveindex_put32(p, len);
+		p = ngx_http_responsiveindex_put32(p, ar->offset);
+		p = ngx_http_responsiveindex_put16(p, 0);
+
+		b->last = p;
+	}
+
+	b->last_buf = (ar->request == ar->request->main) ? 1 : 0;
+	b->last_in_chain = 1;
+
+	return ngx_http_responsiveindex_archive_link(ar, b);
+}
+
+
+static ngx_int_t
+ngx_http_responsiveindex_archive_link(ngx_http_responsiveindex_archive_t *ar, ngx_buf_t *b)
+{
+	ngx_chain_t  *cl;
+
+	cl = ngx_alloc_chain_link(ar->pool);
+	if (cl == NULL) {
+		return NGX_ERROR;
+	}
+
+	cl->buf = b;
+	cl->next = NULL;
+
+	*ar->last = cl;
+	ar->last = &cl->next;
+
+	return NGX_OK;
+}
+
+
+#if (NGX_THREADS)
+
+/*
+ * Runs on the thread pool. Zip wants the CRC before the data, so each file
+ * of the batch is read once for it before it is sent.
+ */
+static void
+ngx_http_responsiveindex_archive_crc_thread(void *data, ngx_log_t *log)
+{
+	ngx_http_responsiveindex_archive_t  *ar = data;
+
+	ngx_uint_t  i;
+
+	for (i = 0; i < ar->nopen; i++) {
+		ar->open[i].rc = ngx_http_responsiveindex_archive_crc(&ar->open[i], ar->crc_buf);
+	}
+}
+
+
+static ngx_int_t
+ngx_http_responsiveindex_archive_crc(ngx_http_responsiveindex_archive_file_t *af,
+		u_char *buf)
+{
+	off_t		offset;
+	ssize_t		n;
+	uint32_t	crc;
+
+	ngx_crc32_init(crc);
+
+	/* By offset, since a file from open_file_cache may be shared. */
+	for (offset = 0; offset < af->size; offset += n) {
+		n = ngx_read_file(&af->file, buf,
+				(size_t) ngx_min(af->size - offset, NGX_HTTP_RESPONSIVEINDEX_ARCHIVE_READ),
+				offset);
+
+		if (n == NGX_ERROR) {
+			return NGX_ERROR;
+		}
+
+		if (n == 0) {
+			ngx_log_error(NGX_LOG_ERR, af->file.log, 0,
+					"\"%V\" was truncated while being archived", &af->file.name);
+			return NGX_ERROR;
+		}
+
+		ngx_crc32_update(&crc, buf, n);
+	}
+
+	ngx_crc32_final(crc);
+
+	af->crc = crc;
+
+	return NGX_OK;
+}
+
+
+static void
+ngx_http_responsiveindex_archive_crc_done(ngx_event_t *ev)
+{
+	ngx_connection_t					*c;
+	ngx_http_request_t					*r;
+	ngx_http_responsiveindex_archive_t	*ar;
+
+	ar = ev->data;
+	r = ar->request;
+	c = r->connection;
+
+	r->main->blocked--;
+	ar->summing = 0;
+
+	if (c->error) {
+		/* The request was cut short meanwhile, and only waited for the thread. */
+		ngx_http_finalize_request(r, NGX_ERROR);
+
+	} else if (ngx_http_responsiveindex_archive_chain(ar) != NGX_OK) {
+		ngx_http_finalize_request(r, NGX_ERROR);
+
+	} else {
+		ngx_http_responsiveindex_archive_send(ar);
+	}
+
+	ngx_http_run_posted_requests(c);
+}
+
+#endif
+
+
+/* Closes the files of the last batch if the request ends before the archive does. */
+static void
+ngx_http_responsiveindex_archive_cleanup(void *data)
+{
+	ngx_http_responsiveindex_archive_t  *ar = data;
+
+	if (ar->pool) {
+		ngx_destroy_pool(ar->pool);
+		ar->pool = NULL;
+	}
+}
+
+
+/* Writes a tar header block in the GNU format, which allows 'L' long name entries. */
+static u_char *
+ngx_http_responsiveindex_tar_header(u_char *p, ngx_str_t *prefix, ngx_str_t *name,
+		u_char type, off_t size, time_t mtime)
+{
+	size_t		n;
+	ngx_uint_t	i, sum;
+
+	ngx_memzero(p, NGX_HTTP_RESPONSIVEINDEX_TAR_BLOCK);
+
+	n = ngx_min(prefix->len, 100);
+	ngx_memcpy(p, prefix->data, n);
+	ngx_memcpy(p + n, name->data, ngx_min(name->len, 100 - n));
+
+	ngx_http_responsiveindex_tar_number(p + 100, 8, 0644);
+	ngx_http_responsiveindex_tar_number(p + 108, 8, 0);
+	ngx_http_responsiveindex_tar_number(p + 116, 8, 0);
+	ngx_http_responsiveindex_tar_number(p + 124, 12, size);
+	ngx_http_responsiveindex_tar_number(p + 136, 12, mtime > 0 ? mtime : 0);
+
+	p[156] = type;
+	ngx_memcpy(p + 257, "ustar  ", sizeof("ustar  "));
+
+	/* The checksum is taken with its own field as spaces. */
+	ngx_memset(p + 148, ' ', 8);
+
+	for (i = 0, sum = 0; i < NGX_HTTP_RESPONSIVEINDEX_TAR_BLOCK; i++) {
+		sum += p[i];
+	}
+
+	ngx_http_responsiveindex_tar_number(p + 148, 7, sum);
+
+	return p + NGX_HTTP_RESPONSIVEINDEX_TAR_BLOCK;
+}
+
+
+/* A tar number field: '\0'-terminated octal, or GNU base-256 when that is too short. */
+static void
+ngx_http_responsiveindex_tar_number(u_char *p, size_t width, uint64_t n)
+{
+	size_t  i;
+
+	if (n >> (3 * (width - 1))) {
+		for (i = width - 1; i > 0; i--) {
+			p[i] = (u_char) n;
+			n >>= 8;
+		}
+
+		p[0] = 0x80;
+		return;
+	}
+
+	p[width - 1] = '\0';
+
+	for (i = width - 1; i > 0; i--) {
+		p[i - 1] = (u_char) ('0' + (n & 7));
+		n >>= 3;
+	}
+}
+
+
+static u_char *
+ngx_http_responsiveindex_put16(u_char *p, uint32_t n)
+{
+	*p++ = (u_char) n;
+	*p++ = (u_char) (n >> 8);
+
+	return p;
+}
+
+
+static u_char *
+ngx_http_responsiveindex_put32(u_char *p, uint32_t n)
+{
+	*p++ = (u_char) n;
+	*p++ = (u_char) (n >> 8);
+	*p++ = (u_char) (n >> 16);
+	*p++ = (u_char) (n >> 24);
+
+	return p;
+}
+
+
+static ngx_buf_t *
+ngx_http_responsiveindex_html(ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf, ngx_array_t *entries)
+{
+	size_t						rows, items;
+	ngx_buf_t					*b;
+	ngx_time_t					*tp;
+	ngx_http_responsiveindex_entry_t	 *entry;
+
+	entry = entries->elts;
+
+	/* We need to calculate the size of the buffer. */
+	ngx_http_responsiveindex_html_sizes(entry, entries->nelts,
+			ngx_http_responsiveindex_utf8(r), &rows, &items);
+
+	/* Allocate a buffer for the response body based on the size we calculated. */
+	b = ngx_create_temp_buf(r->pool, ngx_http_responsiveindex_html_head(NULL, r, conf)
+			+ rows + to_list.len + items + to_html_end.len);
+	if (b == NULL) {
+		return NULL;
+	}
+
+	/* Start adding data to the response. */
+	b->last += ngx_http_responsiveindex_html_head(b->last, r, conf);
+
+	tp = ngx_timeofday();
+
+	ngx_http_responsiveindex_html_rows(b, conf, entry, entries->nelts,
+			tp->gmtoff * 60 * conf->localtime);
+
+	b->last = ngx_cpymem(b->last, to_list.data, to_list.len);
+
+	ngx_http_responsiveindex_html_items(b, entry, entries->nelts);
+
+	b->last = ngx_cpymem(b->last, to_html_end.data, to_html_end.len);
+
+	/* TODO: free temporary pool */
+
+	return b;
+}
+
+
+/*
+ * The page up to the first row of the table. Returns its length, which is
+ * all it works out if p is NULL.
+ */
+static size_t
+ngx_http_responsiveindex_html_head(u_char *p, ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf)
+{
+	u_char		*start;
+	size_t		escape_html;
+	ngx_str_t	*lang;
+
+	escape_html = ngx_escape_html(NULL, r->uri.data, r->uri.len);
+	lang = conf->lang.len ? &conf->lang : &en;
+
+	if (p == NULL) {
+		return r->uri.len + escape_html
+			+ r->uri.len + escape_html
+			+ to_lang.len
+			+ lang->len
+			+ to_stylesheet.len
+			+ (conf->bootstrap_href.len
+				? link_pre_href.len + conf->bootstrap_href.len + link_post_href.len
+				: inline_stylesheet.len)
+			+ to_title.len
+			+ to_h1.len
+			+ to_table_body.len;
+	}
+
+	start = p;
+
+	p = ngx_cpymem(p, to_lang.data, to_lang.len);
+	p = ngx_cpymem(p, lang->data, lang->len);
+	p = ngx_cpymem(p, to_stylesheet.data, to_stylesheet.len);
+
+	if (conf->bootstrap_href.len) {
+		p = ngx_cpymem(p, link_pre_href.data, link_pre_href.len);
+		p = ngx_cpymem(p, conf->bootstrap_href.data, conf->bootstrap_href.len);
+		p = ngx_cpymem(p, link_post_href.data, link_post_href.len);
+	} else {
+		p = ngx_cpymem(p, inline_stylesheet.data, inline_stylesheet.len);
+	}
+
+	p = ngx_cpymem(p, to_title.data, to_title.len);
+
+	if (escape_html) {
+		p = (u_char *) ngx_escape_html(p, r->uri.data, r->uri.len);
+		p = ngx_cpymem(p, to_h1.data, to_h1.len);
+		p = (u_char *) ngx_escape_html(p, r->uri.data, r->uri.len);
+	} else {
+		p = ngx_cpymem(p, r->uri.data, r->uri.len);
+		p = ngx_cpymem(p, to_h1.data, to_h1.len);
+		p = ngx_cpymem(p, r->uri.data, r->uri.len);
+	}
+
+	p = ngx_cpymem(p, to_table_body.data, to_table_body.len);
+
+	return p - start;
+}
+
+
+/*
+ * Works out how each of n entries is escaped, and the length of their
+ * table rows and of their list items.
+ */
+static void
+ngx_http_responsiveindex_html_sizes(ngx_http_responsiveindex_entry_t *entry, ngx_uint_t n,
+		ngx_uint_t utf8, size_t *rows, size_t *items)
+{
+	ngx_uint_t  i;
+
+	*rows = 0;
+	*items = 0;
+
+	for (i = 0; i < n; i++) {
+
+		/* Listings may come from the cache, so escaping is worked out per request. */
+		entry[i].escape = 2 * ngx_escape_uri(NULL, entry[i].name.data,
+				entry[i].name.len, NGX_ESCAPE_URI_COMPONENT);
+
+		entry[i].escape_html = ngx_escape_html(NULL, entry[i].name.data,
+				entry[i].name.len);
+
+		if (utf8) {
+			entry[i].utf_len = ngx_utf8_length(entry[i].name.data, entry[i].name.len);
+		} else {
+			entry[i].utf_len = entry[i].name.len;
+		}
+
+		*rows += entry[i].name.len + entry[i].escape
+
+			/* 1 is for "/" */
+			+ 1
+
+			+ to_td_href.len
+			+ tag_end.len
+			+ entry[i].name.len - entry[i].utf_len
+			+ entry[i].escape_html
+			+ entry[i].name.len
+			+ to_td_date.len
+			+ sizeof("28-Sep-1970 12:00") - 1
+			+ to_td_size.len
+
+			/* the file size */
+			+ 20
+
+			+ end_row.len
+			;
+
+		*items += entry[i].name.len + entry[i].escape
+			+ to_item_href.len
+			+ tag_end.len
+			+ entry[i].name.len - entry[i].utf_len
+			+ entry[i].escape_html
+			+ entry[i].name.len
+
+			/* 1 is for "/" */
+			+ 1
+
+			+ sizeof("\">") - 1
+			+ to_item_end.len
+			;
+	}
+}
+
+
+/* Adds a table row for each of n entries; gmtoff is in seconds. */
+static void
+ngx_http_responsiveindex_html_rows(ngx_buf_t *b, ngx_http_responsiveindex_loc_conf_t *conf,
+		ngx_http_responsiveindex_entry_t *entry, ngx_uint_t n, time_t gmtoff)
+{
+	ngx_tm_t	tm;
+	ngx_uint_t	i;
+
+	static char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+	for (i = 0; i < n; i++) {
+
+		b->last = ngx_cpymem(b->last, to_td_href.data, to_td_href.len);
+
+		ngx_http_responsiveindex_cpy_uri(b, &entry[i]);
+
+		b->last = ngx_cpymem(b->last, tag_end.data, tag_end.len);
+
+		b->last = ngx_cpymem(b->last, entry[i].name.data, entry[i].name.len);
+
+		b->last = ngx_cpymem(b->last, to_td_date.data, to_td_date.len);
+
+		ngx_gmtime(entry[i].mtime + gmtoff, &tm);
+
+
+		b->last = ngx_sprintf(b->last, "%02d-%s-%d %02d:%02d ",
+				tm.ngx_tm_mday,
+				months[tm.ngx_tm_mon - 1],
+				tm.ngx_tm_year,
+				tm.ngx_tm_hour,
+				tm.ngx_tm_min);
+
+		b->last = ngx_cpymem(b->last, to_td_size.data, to_td_size.len);
+
+		ngx_http_responsiveindex_cpy_size(b, &entry[i], conf);
+
+		b->last = ngx_cpymem(b->last, end_row.data, end_row.len);
+	}
+}
+
+
+/* Adds a list item for each of n entries. */
+static void
+ngx_http_responsiveindex_html_items(ngx_buf_t *b, ngx_http_responsiveindex_entry_t *entry,
+		ngx_uint_t n)
+{
+	ngx_uint_t  i;
+
+	for (i = 0; i < n; i++) {
+		b->last = ngx_cpymem(b->last, to_item_href.data,to_item_href.len);
+
+		ngx_http_responsiveindex_cpy_uri(b, &entry[i]);
+
+		b->last = ngx_cpymem(b->last, tag_end.data, tag_end.len);
+
+		b->last = ngx_cpymem(b->last, entry[i].name.data, entry[i].name.len);
+
+		b->last = ngx_cpymem(b->last, to_item_end.data, to_item_end.len);
+
+	}
+}
+
+
+static ngx_uint_t
+ngx_http_responsiveindex_utf8(ngx_http_request_t *r)
+{
+	return r->headers_out.charset.len == 5
+		&& ngx_strncasecmp(r->headers_out.charset.data, (u_char *) "utf-8", 5) == 0;
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_responsiveindex_cmp_entries(const void *one, const void *two)
+{
+	ngx_http_responsiveindex_entry_t *first = (ngx_http_responsiveindex_entry_t *) one;
+	ngx_http_responsiveindex_entry_t *second = (ngx_http_responsiveindex_entry_t *) two;
+
+	if (first->is_dir && !second->is_dir) {
+		/* move the directories to the start */
+		return -1;
+	}
+
+	if (!first->is_dir && second->is_dir) {
+		/* move the directories to the start */
+		return 1;
+	}
+
+	return (int) ngx_strcmp(first->name.data, second->name.data);
+}
+
+
+static ngx_int_t
+ngx_http_responsiveindex_error(ngx_http_responsiveindex_scan_t *scan)
+{
+	scan->opened = 0;
+
+	if (ngx_close_dir(&scan->dir) == NGX_ERROR) {
+		ngx_log_error(NGX_LOG_ALERT, scan->log, ngx_errno,
+				ngx_close_dir_n " \"%V\" failed", &scan->path);
+	}
+
+	return NGX_HTTP_INTERNAL_SERVER_ERROR;
+}
+
+
+/* Serves the built-in stylesheet, for pages that link to it instead of inlining it. */
+static ngx_int_t
+ngx_http_responsiveindex_css_handler(ngx_http_request_t *r)
+{
+	ngx_int_t		rc;
+	ngx_buf_t		*b;
+	ngx_chain_t		out;
+	ngx_table_elt_t	*h;
+
+	if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+		return NGX_HTTP_NOT_ALLOWED;
+	}
+
+	rc = ngx_http_discard_request_body(r);
+
+	if (rc != NGX_OK) {
+		return rc;
+	}
+
+	r->headers_out.status = NGX_HTTP_OK;
+	r->headers_out.content_length_n = builtin_css.len;
+	r->headers_out.content_type_len = sizeof("text/css") - 1;
+	ngx_str_set(&r->headers_out.content_type, "text/css");
+	r->headers_out.content_type_lowcase = NULL;
+
+	/* The stylesheet only changes with the module, so it can be cached for good. */
+
+	h = ngx_list_push(&r->headers_out.headers);
+	if (h == NULL) {
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	h->hash = 1;
+#if (nginx_version >= 1023000)
+	h->next = NULL;
+#endif
+	ngx_str_set(&h->key, "ETag");
+	h->value = builtin_css_etag;
+	r->headers_out.etag = h;
+
+	h = ngx_list_push(&r->headers_out.headers);
+	if (h == NULL) {
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	h->hash = 1;
+#if (nginx_version >= 1023000)
+	h->next = NULL;
+#endif
+	ngx_str_set(&h->key, "Cache-Control");
+	ngx_str_set(&h->value, "public, max-age=31536000, immutable");
+
+	rc = ngx_http_send_header(r);
+
+	/* A matching If-None-Match turns this into a 304 without a body. */
+	if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+		return rc;
+	}
+
+	b = ngx_calloc_buf(r->pool);
+	if (b == NULL) {
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	b->pos = builtin_css.data;
+	b->last = builtin_css.data + builtin_css.len;
+	b->memory = 1;
+	b->last_buf = (r == r->main) ? 1 : 0;
+	b->last_in_chain = 1;
+
+	out.buf = b;
+	out.next = NULL;
+
+	return ngx_http_output_filter(r, &out);
+}
+
+
+/*
+ * Listings are filtered as they are read, so the filters are part of the
+ * key, in full. The key is '\0'-terminated after the path either way.
+ */
+static ngx_int_t
+ngx_http_responsiveindex_cache_key(ngx_pool_t *pool,
+		ngx_http_responsiveindex_loc_conf_t *conf, ngx_str_t *path, ngx_str_t *key)
+{
+	u_char  *p;
+
+	if (conf->filter.len == 0) {
+		*key = *path;
+		return NGX_OK;
+	}
+
+	key->data = ngx_pnalloc(pool, path->len + 1 + conf->filter.len);
+	if (key->data == NULL) {
+		return NGX_ERROR;
+	}
+
+	p = ngx_cpymem(key->data, path->data, path->len);
+	*p++ = '\0';
+	p = ngx_cpymem(p, conf->filter.data, conf->filter.len);
+
+	key->len = p - key->data;
+
+	return NGX_OK;
+}
+
+
+/*
+ * Evicts the least recently used listing. Returns NGX_DECLINED once the
+ * cache is empty. Called with the zone locked.
+ */
+static ngx_int_t
+ngx_http_responsiveindex_cache_expire(ngx_http_responsiveindex_cache_t *cache)
+{
+	ngx_queue_t							*q;
+	ngx_http_responsiveindex_cache_node_t	*node;
+
+	if (ngx_queue_empty(&cache->sh->queue)) {
+		return NGX_DECLINED;
+	}
+
+	q = ngx_queue_last(&cache->sh->queue);
+	node = ngx_queue_data(q, ngx_http_responsiveindex_cache_node_t, queue);
+
+	ngx_queue_remove(q);
+	ngx_rbtree_delete(&cache->sh->rbtree, &node->sn.node);
+	ngx_slab_free_locked(cache->shpool, node);
+
+	return NGX_OK;
+}
+
+
+/*
+ * Looks the directory up in the cache. Returns NGX_OK with the listing
+ * filled in if a usable copy was found, NGX_DECLINED if it has to be read.
+ */
+static ngx_int_t
+ngx_http_responsiveindex_cache_lookup(ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf, ngx_str_t *path, ngx_str_t *key,
+		ngx_http_responsiveindex_listing_t *listing)
+{
+	u_char								*names;
+	time_t								now;
+	uint32_t							hash;
+	ngx_uint_t							i, fresh, update;
+	ngx_file_info_t						fi;
+	ngx_http_responsiveindex_entry_t		*entry, e;
+	ngx_http_responsiveindex_cache_t		*cache;
+	ngx_http_responsiveindex_cache_node_t	*node, copy;
+	ngx_http_responsiveindex_decoder_t		d;
+	ngx_http_responsiveindex_deleted_t		*deleted;
+
+	cache = conf->cache->data;
+	hash = ngx_crc32_short(key->data, key->len);
+	now = ngx_time();
+
+	ngx_shmtx_lock(&cache->shpool->mutex);
+
+	node = (ngx_http_responsiveindex_cache_node_t *)
+		ngx_str_rbtree_lookup(&cache->sh->rbtree, key, hash);
+
+	if (node == NULL) {
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+		return NGX_DECLINED;
+	}
+
+	/* Within responsiveindex_cache_valid the directory is not even looked at. */
+	fresh = node->exact && now - node->checked < conf->cache_valid;
+
+	if (!fresh) {
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+
+		if (ngx_file_info(path->data, &fi) == NGX_FILE_ERROR) {
+			/* Let the read report what is wrong. */
+			return NGX_DECLINED;
+		}
+
+		ngx_shmtx_lock(&cache->shpool->mutex);
+
+		node = (ngx_http_responsiveindex_cache_node_t *)
+			ngx_str_rbtree_lookup(&cache->sh->rbtree, key, hash);
+
+		if (node == NULL) {
+			ngx_shmtx_unlock(&cache->shpool->mutex);
+			return NGX_DECLINED;
+		}
+
+		if (node->exact
+				&& node->mtime == ngx_file_mtime(&fi)
+				&& node->uniq == ngx_file_uniq(&fi))
+		{
+			node->checked = now;
+			fresh = 1;
+		}
+	}
+
+	update = 0;
+
+	if (!fresh) {
+		if (!conf->cache_background_update) {
+			ngx_shmtx_unlock(&cache->shpool->mutex);
+			return NGX_DECLINED;
+		}
+
+		/* Serve the stale copy; only the first request to see it starts a reread. */
+		if (node->updating == 0
+				|| now - node->updating > NGX_HTTP_RESPONSIVEINDEX_UPDATE_TIMEOUT)
+		{
+			node->updating = now;
+			update = 1;
+		}
+	}
+
+	ngx_queue_remove(&node->queue);
+	ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+	/*
+	 * Only copy the coded listing out under the lock, as cache_store does,
+	 * and decode it once unlocked.
+	 */
+
+	copy = *node;
+
+	if (listing->since == -1) {
+		copy.entries = ngx_pnalloc(r->pool, node->deleted - node->entries);
+		if (copy.entries == NULL) {
+			ngx_shmtx_unlock(&cache->shpool->mutex);
+			return NGX_ERROR;
+		}
+
+		ngx_memcpy(copy.entries, node->entries, node->deleted - node->entries);
+
+	} else if (ngx_http_responsiveindex_cache_poll(r, node, listing->since, &copy)
+			!= NGX_OK)
+	{
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+		return NGX_ERROR;
+	}
+
+	ngx_shmtx_unlock(&cache->shpool->mutex);
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"http responsiveindex cache hit: \"%s\" fresh:%ui", path->data, fresh);
+
+	listing->mtime = copy.mtime;
+	listing->uniq = copy.uniq;
+	listing->scanned = copy.checked;
+
+	if (update
+			&& ngx_http_responsiveindex_cache_update(conf, path, key, NULL) != NGX_OK)
+	{
+		ngx_shmtx_lock(&cache->shpool->mutex);
+
+		node = (ngx_http_responsiveindex_cache_node_t *)
+			ngx_str_rbtree_lookup(&cache->sh->rbtree, key, hash);
+
+		if (node) {
+			node->updating = 0;
+		}
+
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+	}
+
+	d.name = ngx_pnalloc(r->pool, copy.name_max + 1);
+	if (d.name == NULL) {
+		return NGX_ERROR;
+	}
+
+	d.pos = copy.entries;
+	d.mtime = 0;
+	d.n = 0;
+
+	if (listing->since == -1) {
+		entry = ngx_array_push_n(&listing->entries, copy.nelts);
+		names = ngx_pnalloc(r->pool, copy.names_len);
+
+		if (entry == NULL || names == NULL) {
+			return NGX_ERROR;
+		}
+
+		for (i = 0; i < copy.nelts; i++) {
+			ngx_http_responsiveindex_decode(&d, &entry[i]);
+
+			entry[i].name.data = names;
+			names = ngx_cpymem(names, d.name, entry[i].name.len + 1);
+		}
+
+		return NGX_OK;
+	}
+
+	/* A poll only keeps what changed, and the names deleted meanwhile. */
+
+	for (i = 0; i < copy.nelts; i++) {
+		ngx_http_responsiveindex_decode(&d, &e);
+
+		if (e.mtime > listing->since) {
+			entry = ngx_array_push(&listing->entries);
+			if (entry == NULL) {
+				return NGX_ERROR;
+			}
+
+			*entry = e;
+
+			entry->name.data = ngx_pnalloc(r->pool, e.name.len + 1);
+			if (entry->name.data == NULL) {
+				return NGX_ERROR;
+			}
+
+			ngx_memcpy(entry->name.data, d.name, e.name.len + 1);
+		}
+	}
+
+	if (copy.deleted_from > listing->since) {
+		return NGX_OK;
+	}
+
+	listing->deleted = ngx_array_create(r->pool, 4,
+			sizeof(ngx_http_responsiveindex_deleted_t));
+	if (listing->deleted == NULL) {
+		return NGX_ERROR;
+	}
+
+	d.pos = copy.deleted;
+	d.mtime = 0;
+	d.n = 0;
+
+	for (i = 0; i < copy.ndeleted; i++) {
+		ngx_http_responsiveindex_decode(&d, &e);
+
+		if (e.mtime > listing->since) {
+			deleted = ngx_array_push(listing->deleted);
+			if (deleted == NULL) {
+				return NGX_ERROR;
+			}
+
+			deleted->name.len = e.name.len;
+			deleted->name.data = ngx_pnalloc(r->pool, e.name.len + 1);
+			if (deleted->name.data == NULL) {
+				return NGX_ERROR;
+			}
+
+			ngx_memcpy(deleted->name.data, d.name, e.name.len + 1);
+			deleted->time = e.mtime;
+		}
+	}
+
+	return NGX_OK;
+}
+
+
+/*
+ * Copies into copy, with the lock held, only the runs of entries a poll
+ * since that time needs, and the deleted names if they tell it anything.
+ */
+static ngx_int_t
+ngx_http_responsiveindex_cache_poll(ngx_http_request_t *r,
+		ngx_http_responsiveindex_cache_node_t *node, time_t since,
+		ngx_http_responsiveindex_cache_node_t *copy)
+{
+	u_char								*p, *end;
+	size_t								size, deleted_size;
+	ngx_uint_t							i, n;
+	ngx_http_responsiveindex_restart_t	*rp;
+
+	n = (node->nelts + NGX_HTTP_RESPONSIVEINDEX_RESTART - 1)
+		/ NGX_HTTP_RESPONSIVEINDEX_RESTART;
+
+	if (node->changed <= since) {
+		/* Nothing to look for among the runs. */
+		n = 0;
+	}
+
+	rp = node->restarts;
+	size = 0;
+
+	for (i = 0; i < n; i++) {
+		if (rp[i].mtime > since) {
+			end = (i + 1 < n) ? node->entries + rp[i + 1].offset : node->deleted;
+			size += end - (node->entries + rp[i].offset);
+		}
+	}
+
+	deleted_size = (node->deleted_from <= since && node->deleted_last > since)
+		? (size_t) (node->last - node->deleted) : 0;
+
+	copy->nelts = 0;
+	copy->ndeleted = deleted_size ? node->ndeleted : 0;
+
+	if (size + deleted_size == 0) {
+		return NGX_OK;
+	}
+
+	p = ngx_pnalloc(r->pool, size + deleted_size);
+	if (p == NULL) {
+		return NGX_ERROR;
+	}
+
+	copy->entries = p;
+
+	/*
+	 * Each run starts with a restart point, and all but the last one of the
+	 * listing are full, so the runs copied decode as one.
+	 */
+
+	for (i = 0; i < n; i++) {
+		if (rp[i].mtime > since) {
+			end = (i + 1 < n) ? node->entries + rp[i + 1].offset : node->deleted;
+			p = ngx_cpymem(p, node->entries + rp[i].offset,
+					end - (node->entries + rp[i].offset));
+
+			copy->nelts += ngx_min(NGX_HTTP_RESPONSIVEINDEX_RESTART,
+					node->nelts - i * NGX_HTTP_RESPONSIVEINDEX_RESTART);
+		}
+	}
+
+	copy->deleted = p;
+
+	ngx_memcpy(p, node->deleted, deleted_size);
+
+	return NGX_OK;
+}
+
+
+static void
+ngx_http_responsiveindex_cache_store(ngx_shm_zone_t *zone, ngx_str_t *key,
+		ngx_http_responsiveindex_listing_t *listing)
+{
+	u_char								*p, *entries, *gone;
+	size_t								size, names_len, name_max, deleted_max,
+										entries_size, deleted_size, restarts_size,
+										offset;
+	time_t								deleted_from, changed, deleted_last;
+	uint32_t							hash;
+	ngx_uint_t							i, n, generation, current, diffed;
+	ngx_array_t							deleted;
+	ngx_http_responsiveindex_entry_t		*entry, *de;
+	ngx_http_responsiveindex_cache_t		*cache;
+	ngx_http_responsiveindex_cache_node_t	*node, *old, copy;
+	ngx_http_responsiveindex_deleted_t		*d;
+	ngx_http_responsiveindex_restart_t		*restarts;
+
+	cache = zone->data;
+	entry = listing->entries.elts;
+
+	names_len = 0;
+	name_max = 0;
+	changed = 0;
+
+	for (i = 0; i < listing->entries.nelts; i++) {
+		names_len += entry[i].name.len + 1;
+		name_max = ngx_max(name_max, entry[i].name.len);
+		changed = ngx_max(changed, entry[i].mtime);
+	}
+
+	/* The listing is sorted, so neighbours share their prefixes. */
+	entries_size = ngx_http_responsiveindex_encode(NULL, entry, listing->entries.nelts,
+			NULL);
+
+	restarts_size = (listing->entries.nelts + NGX_HTTP_RESPONSIVEINDEX_RESTART - 1)
+		/ NGX_HTTP_RESPONSIVEINDEX_RESTART * sizeof(ngx_http_responsiveindex_restart_t);
+
+	/* It is coded here and only copied in with the lock held. */
+	entries = ngx_pnalloc(listing->entries.pool, ngx_max(entries_size, 1));
+	restarts = ngx_palloc(listing->entries.pool, ngx_max(restarts_size, 1));
+
+	if (entries == NULL || restarts == NULL) {
+		return;
+	}
+
+	ngx_http_responsiveindex_encode(entries, entry, listing->entries.nelts, restarts);
+
+	if (ngx_array_init(&deleted, listing->entries.pool, 4,
+				sizeof(ngx_http_responsiveindex_deleted_t))
+			!= NGX_OK)
+	{
+		return;
+	}
+
+	hash = ngx_crc32_short(key->data, key->len);
+
+	generation = 0;
+	diffed = 0;
+	gone = NULL;
+	deleted_max = 0;
+	deleted_size = 0;
+	deleted_from = 0;
+	deleted_last = 0;
+
+	/*
+	 * Whatever the previous copy had that this one lacks has been deleted.
+	 * That is worked out on a copy of it, without the lock; if another
+	 * worker stored the listing meanwhile, it is done again against that.
+	 */
+
+	for ( ;; ) {
+		ngx_shmtx_lock(&cache->shpool->mutex);
+
+		node = (ngx_http_responsiveindex_cache_node_t *)
+			ngx_str_rbtree_lookup(&cache->sh->rbtree, key, hash);
+
+		current = node ? node->generation : 0;
+
+		if (diffed && current == generation) {
+			break;
+		}
+
+		old = NULL;
+
+		if (node) {
+			size = node->last - node->entries;
+
+			p = ngx_pnalloc(listing->entries.pool, size);
+			if (p == NULL) {
+				ngx_shmtx_unlock(&cache->shpool->mutex);
+				return;
+			}
+
+			ngx_memcpy(p, node->entries, size);
+
+			copy = *node;
+			copy.entries = p;
+			copy.deleted = p + (node->deleted - node->entries);
+
+			old = &copy;
+		}
+
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+
+		generation = current;
+		diffed = 1;
+
+		deleted.nelts = 0;
+
+		if (ngx_http_responsiveindex_cache_diff(old, listing, &deleted, &deleted_from)
+				!= NGX_OK)
+		{
+			return;
+		}
+
+		/* The deleted names are coded as entries whose mtime is when they went. */
+
+		d = deleted.elts;
+
+		de = ngx_pnalloc(listing->entries.pool,
+				ngx_max(deleted.nelts, 1) * sizeof(ngx_http_responsiveindex_entry_t));
+		if (de == NULL) {
+			return;
+		}
+
+		deleted_max = 0;
+		deleted_last = 0;
+
+		for (i = 0; i < deleted.nelts; i++) {
+			ngx_memzero(&de[i], sizeof(ngx_http_responsiveindex_entry_t));
+
+			de[i].name = d[i].name;
+			de[i].mtime = d[i].time;
+
+			deleted_max = ngx_max(deleted_max, d[i].name.len);
+			deleted_last = ngx_max(deleted_last, d[i].time);
+		}
+
+		deleted_size = ngx_http_responsiveindex_encode(NULL, de, deleted.nelts, NULL);
+
+		gone = ngx_pnalloc(listing->entries.pool, ngx_max(deleted_size, 1));
+		if (gone == NULL) {
+			return;
+		}
+
+		ngx_http_responsiveindex_encode(gone, de, deleted.nelts, NULL);
+	}
+
+	if (node) {
+		ngx_queue_remove(&node->queue);
+		ngx_rbtree_delete(&cache->sh->rbtree, &node->sn.node);
+		ngx_slab_free_locked(cache->shpool, node);
+	}
+
+	d = deleted.elts;
+
+	/*
+	 * The node, its key, the restart points, the coded entries and deleted
+	 * names go into one allocation.
+	 */
+
+	offset = ngx_align(offsetof(ngx_http_responsiveindex_cache_node_t, key) + key->len,
+			NGX_ALIGNMENT);
+	size = offset + restarts_size + entries_size + deleted_size;
+
+	for ( ;; ) {
+		node = ngx_slab_alloc_locked(cache->shpool, size);
+		if (node) {
+			break;
+		}
+
+		if (ngx_http_responsiveindex_cache_expire(cache) != NGX_OK) {
+			ngx_shmtx_unlock(&cache->shpool->mutex);
+
+			ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+					"responsiveindex: listing of \"%s\" does not fit in zone \"%V\"",
+					key->data, &zone->shm.name);
+			return;
+		}
+	}
+
+	ngx_memcpy(node->key, key->data, key->len);
+
+	node->sn.node.key = hash;
+	node->sn.str.len = key->len;
+	node->sn.str.data = node->key;
+
+	node->mtime = listing->mtime;
+	node->uniq = listing->uniq;
+	node->checked = listing->scanned;
+	node->updating = 0;
+	node->exact = listing->mtime < listing->scanned;
+
+	node->nelts = listing->entries.nelts;
+	node->names_len = names_len;
+	node->restarts = (ngx_http_responsiveindex_restart_t *) ((u_char *) node + offset);
+	node->entries = (u_char *) node->restarts + restarts_size;
+
+	node->ndeleted = deleted.nelts;
+	node->deleted = node->entries + entries_size;
+	node->deleted_from = deleted_from;
+	node->last = node->deleted + deleted_size;
+
+	node->changed = changed;
+	node->deleted_last = deleted_last;
+
+	node->generation = ++cache->sh->generation;
+
+	node->name_max = ngx_max(name_max, deleted_max);
+
+	ngx_memcpy(node->restarts, restarts, restarts_size);
+	ngx_memcpy(node->entries, entries, entries_size);
+	ngx_memcpy(node->deleted, gone, deleted_size);
+
+	ngx_log_debug4(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+			"http responsiveindex cache store: \"%s\" %ui entries in %uz bytes, names %uz",
+			key->data, node->nelts, entries_size, names_len);
+
+	ngx_rbtree_insert(&cache->sh->rbtree, &node->sn.node);
+	ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+	ngx_shmtx_unlock(&cache->shpool->mutex);
+
+	/* A poll that had to read the directory gets the deletions from here. */
+	if (listing->since != -1 && deleted_from <= listing->since) {
+
+		for (i = 0, n = 0; i < deleted.nelts; i++) {
+			if (d[i].time > listing->since) {
+				d[n++] = d[i];
+			}
+		}
+
+		deleted.nelts = n;
+
+		listing->deleted = ngx_palloc(listing->entries.pool, sizeof(ngx_array_t));
+		if (listing->deleted) {
+			*listing->deleted = deleted;
+		}
+	}
+}
+
+
+/*
+ * Collects the names the previous copy of a listing remembered as deleted,
+ * plus those it had that the new one does not, into deleted, oldest first.
+ */
+static ngx_int_t
+ngx_http_responsiveindex_cache_diff(ngx_http_responsiveindex_cache_node_t *node,
+		ngx_http_responsiveindex_listing_t *listing, ngx_array_t *deleted, time_t *from)
+{
+	ngx_uint_t							i, n, k;
+	ngx_pool_t							*pool;
+	ngx_http_responsiveindex_entry_t		e;
+	ngx_http_responsiveindex_decoder_t	dec;
+	ngx_http_responsiveindex_deleted_t	*d;
+
+	if (node == NULL) {
+		/* Nothing to tell deletions from before this read by. */
+		*from = listing->scanned - 1;
+		return NGX_OK;
+	}
+
+	*from = node->deleted_from;
+	pool = listing->entries.pool;
+
+	dec.name = ngx_pnalloc(pool, node->name_max + 1);
+	if (dec.name == NULL) {
+		return NGX_ERROR;
+	}
+
+	for (k = 0; k < 2; k++) {
+
+		if (k == 0) {
+			/* Those already known, unless the name is back. */
+			dec.pos = node->deleted;
+			n = node->ndeleted;
+
+		} else {
+			dec.pos = node->entries;
+			n = node->nelts;
+		}
+
+		dec.mtime = 0;
+		dec.n = 0;
+
+		for (i = 0; i < n; i++) {
+			ngx_http_responsiveindex_decode(&dec, &e);
+
+			if (!ngx_http_responsiveindex_listed(&listing->entries, dec.name, e.name.len)) {
+				d = ngx_array_push(deleted);
+				if (d == NULL) {
+					return NGX_ERROR;
+				}
+
+				d->name.len = e.name.len;
+				d->name.data = ngx_pnalloc(pool, e.name.len + 1);
+				if (d->name.data == NULL) {
+					return NGX_ERROR;
+				}
+
+				ngx_memcpy(d->name.data, dec.name, e.name.len + 1);
+
+				/* A new deletion happened at some point before this read. */
+				d->time = k ? listing->scanned : e.mtime;
+			}
+		}
+	}
+
+	/* Forget the oldest ones, and that anything before them is known. */
+	if (deleted->nelts > NGX_HTTP_RESPONSIVEINDEX_DELETED_MAX) {
+		n = deleted->nelts - NGX_HTTP_RESPONSIVEINDEX_DELETED_MAX;
+		d = deleted->elts;
+
+		*from = ngx_max(*from, d[n - 1].time);
+
+		ngx_memmove(d, d + n,
+				NGX_HTTP_RESPONSIVEINDEX_DELETED_MAX * sizeof(ngx_http_responsiveindex_deleted_t));
+		deleted->nelts = NGX_HTTP_RESPONSIVEINDEX_DELETED_MAX;
+	}
+
+	return NGX_OK;
+}
+
+
+/* Returns 1 if a sorted listing has an entry of that name, be it a file or a directory. */
+static ngx_uint_t
+ngx_http_responsiveindex_listed(ngx_array_t *entries, u_char *name, size_t len)
+{
+	ngx_http_responsiveindex_entry_t  key;
+
+	key.name.len = len;
+	key.name.data = name;
+
+	key.is_dir = 1;
+
+	if (bsearch(&key, entries->elts, entries->nelts,
+				sizeof(ngx_http_responsiveindex_entry_t),
+				ngx_http_responsiveindex_cmp_entries))
+	{
+		return 1;
+	}
+
+	key.is_dir = 0;
+
+	return bsearch(&key, entries->elts, entries->nelts,
+			sizeof(ngx_http_responsiveindex_entry_t),
+			ngx_http_responsiveindex_cmp_entries)
+		!= NULL;
+}
+
+
+/*
+ * Front-codes n entries into p, in the format above, and fills in their
+ * restart points if restart is not NULL. Returns the length, which is all
+ * it works out if p is NULL.
+ */
+static size_t
+ngx_http_responsiveindex_encode(u_char *p, ngx_http_responsiveindex_entry_t *entry,
+		ngx_uint_t n, ngx_http_responsiveindex_restart_t *restart)
+{
+	u_char								*start, *a, *b;
+	size_t								len, shared;
+	int64_t								delta;
+	uint64_t							zigzag, tail;
+	ngx_uint_t							i;
+	ngx_http_responsiveindex_restart_t	*rp;
+
+	start = p;
+	len = 0;
+
+	for (i = 0; i < n; i++) {
+		shared = 0;
+		delta = entry[i].mtime;
+
+		if (p && restart) {
+			rp = &restart[i / NGX_HTTP_RESPONSIVEINDEX_RESTART];
+
+			if (i % NGX_HTTP_RESPONSIVEINDEX_RESTART == 0) {
+				rp->offset = p - start;
+				rp->mtime = entry[i].mtime;
+
+			} else {
+				rp->mtime = ngx_max(rp->mtime, entry[i].mtime);
+			}
+		}
+
+		if (i % NGX_HTTP_RESPONSIVEINDEX_RESTART) {
+			a = entry[i - 1].name.data;
+			b = entry[i].name.data;
+
+			while (shared < entry[i - 1].name.len && shared < entry[i].name.len
+					&& a[shared] == b[shared])
+			{
+				shared++;
+			}
+
+			delta -= entry[i - 1].mtime;
+		}
+
+		zigzag = ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63);
+		tail = entry[i].is_dir ? (uint64_t) entry[i].uniq : (uint64_t) entry[i].size;
+
+		if (p == NULL) {
+			len += ngx_http_responsiveindex_varint_len(shared)
+				+ ngx_http_responsiveindex_varint_len((entry[i].name.len - shared) << 1)
+				+ entry[i].name.len - shared
+				+ ngx_http_responsiveindex_varint_len(zigzag)
+				+ ngx_http_responsiveindex_varint_len(tail);
+
+			if (entry[i].is_dir) {
+				len += ngx_http_responsiveindex_varint_len((uint64_t) entry[i].dev);
+			}
+
+			continue;
+		}
+
+		p = ngx_http_responsiveindex_put_varint(p, shared);
+		p = ngx_http_responsiveindex_put_varint(p,
+				((entry[i].name.len - shared) << 1) | (entry[i].is_dir ? 1 : 0));
+		p = ngx_cpymem(p, entry[i].name.data + shared, entry[i].name.len - shared);
+		p = ngx_http_responsiveindex_put_varint(p, zigzag);
+		p = ngx_http_responsiveindex_put_varint(p, tail);
+
+		if (entry[i].is_dir) {
+			p = ngx_http_responsiveindex_put_varint(p, (uint64_t) entry[i].dev);
+		}
+	}
+
+	return p ? (size_t) (p - start) : len;
+}
+
+
+/*
+ * Decodes the next entry. Its name is left in d->name, where the next entry
+ * finds the prefix it shares, so callers copy it out before going on.
+ */
+static void
+ngx_http_responsiveindex_decode(ngx_http_responsiveindex_decoder_t *d,
+		ngx_http_responsiveindex_entry_t *entry)
+{
+	u_char		*p;
+	size_t		shared, rest;
+	int64_t		delta;
+	uint64_t	v;
+
+	p = d->pos;
+
+	p = ngx_http_responsiveindex_get_varint(p, &v);
+	shared = (size_t) v;
+
+	p = ngx_http_responsiveindex_get_varint(p, &v);
+	rest = (size_t) (v >> 1);
+	entry->is_dir = v & 1;
+
+	ngx_memcpy(d->name + shared, p, rest);
+	d->name[shared + rest] = '\0';
+	p += rest;
+
+	p = ngx_http_responsiveindex_get_varint(p, &v);
+	delta = (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+
+	if (d->n++ % NGX_HTTP_RESPONSIVEINDEX_RESTART == 0) {
+		d->mtime = 0;
+	}
+
+	d->mtime += (time_t) delta;
+
+	p = ngx_http_responsiveindex_get_varint(p, &v);
+
+	entry->name.len = shared + rest;
+	entry->name.data = d->name;
+	entry->sized = 0;
+	entry->mtime = d->mtime;
+	entry->size = entry->is_dir ? 0 : (off_t) v;
+	entry->files = 0;
+	entry->uniq = entry->is_dir ? (ngx_file_uniq_t) v : 0;
+	entry->dev = 0;
+
+	if (entry->is_dir) {
+		p = ngx_http_responsiveindex_get_varint(p, &v);
+		entry->dev = (dev_t) v;
+	}
+
+	d->pos = p;
+}
+
+
+static u_char *
+ngx_http_responsiveindex_put_varint(u_char *p, uint64_t n)
+{
+	while (n >= 0x80) {
+		*p++ = (u_char) (n | 0x80);
+		n >>= 7;
+	}
+
+	*p++ = (u_char) n;
+
+	return p;
+}
+
+
+static u_char *
+ngx_http_responsiveindex_get_varint(u_char *p, uint64_t *n)
+{
+	uint64_t	v;
+	ngx_uint_t	shift;
+
+	v = 0;
+	shift = 0;
+
+	while (*p & 0x80) {
+		v |= (uint64_t) (*p++ & 0x7f) << shift;
+		shift += 7;
+	}
+
+	*n = v | (uint64_t) *p++ << shift;
+
+	return p;
+}
+
+
+static size_t
+ngx_http_responsiveindex_varint_len(uint64_t n)
+{
+	size_t  len;
+
+	for (len = 1; n >= 0x80; len++) {
+		n >>= 7;
+	}
+
+	return len;
+}
+
+
+static void
+ngx_http_responsiveindex_cache_delete(ngx_shm_zone_t *zone, ngx_str_t *key)
+{
+	uint32_t							hash;
+	ngx_http_responsiveindex_cache_t		*cache;
+	ngx_http_responsiveindex_cache_node_t	*node;
+
+	cache = zone->data;
+	hash = ngx_crc32_short(key->data, key->len);
+
+	ngx_shmtx_lock(&cache->shpool->mutex);
+
+	node = (ngx_http_responsiveindex_cache_node_t *)
+		ngx_str_rbtree_lookup(&cache->sh->rbtree, key, hash);
+
+	if (node) {
+		ngx_queue_remove(&node->queue);
+		ngx_rbtree_delete(&cache->sh->rbtree, &node->sn.node);
+		ngx_slab_free_locked(cache->shpool, node);
+	}
+
+	ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+/* Schedules a reread of path once the current request has been answered. */
+static ngx_int_t
+ngx_http_responsiveindex_cache_update(ngx_http_responsiveindex_loc_conf_t *conf,
+		ngx_str_t *path, ngx_str_t *key, ngx_http_responsiveindex_prefetch_t *prefetch)
+{
+	ngx_pool_t							*pool;
+	ngx_pool_cleanup_t					*cln;
+	ngx_http_responsiveindex_update_t	*u;
+
+	pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+	if (pool == NULL) {
+		return NGX_ERROR;
+	}
+
+	u = ngx_pcalloc(pool, sizeof(ngx_http_responsiveindex_update_t));
+	if (u == NULL) {
+		goto failed;
+	}
+
+	u->conf = conf;
+	u->prefetch = prefetch;
+
+	if (ngx_http_responsiveindex_scan_init(&u->scan, pool, ngx_cycle->log, conf)
+			!= NGX_OK)
+	{
+		goto failed;
+	}
+
+	/* Reading ahead gives way to requests sooner. */
+	if (prefetch) {
+		u->scan.budget = conf->prefetch_budget;
+	}
+
+	u->scan.path.len = path->len;
+	u->scan.path.data = ngx_pnalloc(pool, path->len + 1);
+	if (u->scan.path.data == NULL) {
+		goto failed;
+	}
+
+	ngx_cpystrn(u->scan.path.data, path->data, path->len + 1);
+
+	u->scan.key.len = key->len;
+	u->scan.key.data = ngx_pnalloc(pool, key->len + 1);
+	if (u->scan.key.data == NULL) {
+		goto failed;
+	}
+
+	*ngx_cpymem(u->scan.key.data, key->data, key->len) = '\0';
+
+	cln = ngx_pool_cleanup_add(pool, 0);
+	if (cln == NULL) {
+		goto failed;
+	}
+
+	cln->handler = ngx_http_responsiveindex_scan_cleanup;
+	cln->data = &u->scan;
+
+	u->scan.done = ngx_http_responsiveindex_cache_update_done;
+	u->scan.data = u;
+
+	ngx_add_timer(&u->scan.event, 0);
+
+	return NGX_OK;
+
+failed:
+
+	ngx_destroy_pool(pool);
+
+	return NGX_ERROR;
+}
+
+
+static void
+ngx_http_responsiveindex_cache_update_done(ngx_http_responsiveindex_scan_t *scan,
+		ngx_int_t rc)
+{
+	ngx_http_responsiveindex_update_t	*u;
+
+	u = scan->data;
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, scan->log, 0,
+			"http responsiveindex cache update: \"%s\" %i", scan->path.data, rc);
+
+	if (rc == NGX_OK) {
+		ngx_http_responsiveindex_cache_store(u->conf->cache, &scan->key,
+				&scan->listing);
+
+	} else if (u->prefetch == NULL) {
+		/* Whatever went wrong, the next request should find out for itself. */
+		ngx_http_responsiveindex_cache_delete(u->conf->cache, &scan->key);
+	}
+
+	if (u->prefetch) {
+		ngx_queue_remove(&u->prefetch->queue);
+		ngx_free(u->prefetch);
+
+		ngx_http_responsiveindex_prefetch_queued--;
+		ngx_http_responsiveindex_prefetch_running--;
+	}
+
+	ngx_destroy_pool(scan->pool);
+
+	ngx_http_responsiveindex_prefetch_next();
+}
+
+
+/*
+ * Queues reads of the most recently modified subdirectories of a listing
+ * into the cache, as the next request is likely to be for one of those.
+ */
+static void
+ngx_http_responsiveindex_prefetch(ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf, ngx_array_t *entries)
+{
+	u_char								*last, *p;
+	size_t								root;
+	ngx_str_t							path, dir, key;
+	ngx_uint_t							i, k, n;
+	ngx_http_responsiveindex_entry_t	*entry, **top;
+
+	top = ngx_palloc(r->pool, conf->prefetch * sizeof(ngx_http_responsiveindex_entry_t *));
+	if (top == NULL) {
+		return;
+	}
+
+	entry = entries->elts;
+
+	/* The newest first. */
+
+	for (i = 0, n = 0; i < entries->nelts; i++) {
+
+		if (!entry[i].is_dir
+			|| (n == conf->prefetch && entry[i].mtime <= top[n - 1]->mtime))
+		{
+			continue;
+		}
+
+		k = (n < conf->prefetch) ? n++ : n - 1;
+
+		while (k > 0 && top[k - 1]->mtime < entry[i].mtime) {
+			top[k] = top[k - 1];
+			k--;
+		}
+
+		top[k] = &entry[i];
+	}
+
+	if (n == 0) {
+		return;
+	}
+
+	last = ngx_http_map_uri_to_path(r, &path, &root, 0);
+	if (last == NULL) {
+		return;
+	}
+
+	path.len = last - path.data;
+	if (path.len > 1) {
+		path.len--;
+	}
+
+	for (k = 0; k < n; k++) {
+		dir.len = path.len + 1 + top[k]->name.len;
+		dir.data = ngx_pnalloc(r->pool, dir.len + 1);
+		if (dir.data == NULL) {
+			return;
+		}
+
+		p = ngx_cpymem(dir.data, path.data, path.len);
+		*p++ = '/';
+		ngx_cpystrn(p, top[k]->name.data, top[k]->name.len + 1);
+
+		if (ngx_http_responsiveindex_cache_key(r->pool, conf, &dir, &key) != NGX_OK) {
+			return;
+		}
+
+		ngx_http_responsiveindex_prefetch_add(conf, &dir, &key);
+	}
+
+	ngx_http_responsiveindex_prefetch_next();
+}
+
+
+/* Queues a directory to read ahead, unless it is cached or queued already. */
+static void
+ngx_http_responsiveindex_prefetch_add(ngx_http_responsiveindex_loc_conf_t *conf,
+		ngx_str_t *path, ngx_str_t *key)
+{
+	u_char								*p;
+	uint32_t							hash;
+	ngx_queue_t							*q;
+	ngx_str_node_t						*node;
+	ngx_http_responsiveindex_cache_t	*cache;
+	ngx_http_responsiveindex_prefetch_t	*pf;
+
+	if (ngx_http_responsiveindex_prefetch_queued == NGX_HTTP_RESPONSIVEINDEX_PREFETCH_MAX) {
+		return;
+	}
+
+	/* Even a stale copy is left for a request to refresh. */
+
+	cache = conf->cache->data;
+	hash = ngx_crc32_short(key->data, key->len);
+
+	ngx_shmtx_lock(&cache->shpool->mutex);
+
+	node = ngx_str_rbtree_lookup(&cache->sh->rbtree, key, hash);
+
+	ngx_shmtx_unlock(&cache->shpool->mutex);
+
+	if (node) {
+		return;
+	}
+
+	for (q = ngx_queue_head(&ngx_http_responsiveindex_prefetch_queue);
+		 q != ngx_queue_sentinel(&ngx_http_responsiveindex_prefetch_queue);
+		 q = ngx_queue_next(q))
+	{
+		pf = ngx_queue_data(q, ngx_http_responsiveindex_prefetch_t, queue);
+
+		if (pf->key.len == key->len && ngx_memcmp(pf->key.data, key->data, key->len) == 0) {
+			return;
+		}
+	}
+
+	/* Queued directories outlive the request, so they are allocated apart. */
+	pf = ngx_alloc(sizeof(ngx_http_responsiveindex_prefetch_t) + path->len + 1
+			+ key->len + 1, ngx_cycle->log);
+	if (pf == NULL) {
+		return;
+	}
+
+	p = (u_char *) (pf + 1);
+
+	pf->conf = conf;
+	pf->running = 0;
+
+	pf->path.len = path->len;
+	pf->path.data = p;
+	p = ngx_cpymem(p, path->data, path->len);
+	*p++ = '\0';
+
+	pf->key.len = key->len;
+	pf->key.data = p;
+	p = ngx_cpymem(p, key->data, key->len);
+	*p = '\0';
+
+	ngx_queue_insert_tail(&ngx_http_responsiveindex_prefetch_queue, &pf->queue);
+	ngx_http_responsiveindex_prefetch_queued++;
+}
+
+
+/*
+ * Starts reading queued directories, each only while fewer reads are
+ * running than the responsiveindex_prefetch_concurrency it was queued with.
+ */
+static void
+ngx_http_responsiveindex_prefetch_next(void)
+{
+	ngx_queue_t							*q, *next;
+	ngx_http_responsiveindex_prefetch_t	*pf;
+
+	for (q = ngx_queue_head(&ngx_http_responsiveindex_prefetch_queue);
+		 q != ngx_queue_sentinel(&ngx_http_responsiveindex_prefetch_queue);
+		 q = next)
+	{
+		next = ngx_queue_next(q);
+
+		pf = ngx_queue_data(q, ngx_http_responsiveindex_prefetch_t, queue);
+
+		if (pf->running) {
+			continue;
+		}
+
+		if (ngx_http_responsiveindex_prefetch_running >= pf->conf->prefetch_concurrency) {
+			continue;
+		}
+
+		if (ngx_http_responsiveindex_cache_update(pf->conf, &pf->path, &pf->key, pf)
+				!= NGX_OK)
+		{
+			ngx_queue_remove(q);
+			ngx_free(pf);
+			ngx_http_responsiveindex_prefetch_queued--;
+			continue;
+		}
+
+		pf->running = 1;
+		ngx_http_responsiveindex_prefetch_running++;
+	}
+}
+
+
+/* Orders directory totals by inode, then device, as ngx_http_responsiveindex_size_lookup expects. */
+static void
+ngx_http_responsiveindex_size_insert_value(ngx_rbtree_node_t *temp,
+		ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+	ngx_rbtree_node_t						**p;
+	ngx_http_responsiveindex_size_node_t	*n, *t;
+
+	for ( ;; ) {
+
+		if (node->key != temp->key) {
+			p = (node->key < temp->key) ? &temp->left : &temp->right;
+
+		} else {
+			n = (ngx_http_responsiveindex_size_node_t *) node;
+			t = (ngx_http_responsiveindex_size_node_t *) temp;
+
+			p = (n->dev < t->dev) ? &temp->left : &temp->right;
+		}
+
+		if (*p == sentinel) {
+			break;
+		}
+
+		temp = *p;
+	}
+
+	*p = node;
+	node->parent = temp;
+	node->left = sentinel;
+	node->right = sentinel;
+	ngx_rbt_red(node);
+}
+
+
+#if (NGX_THREADS)
+
+/*
+ * Fills in the totals known for the directories of a listing, and starts
+ * walks for the ones without, or with outdated ones. Nothing waits for a
+ * walk: its totals turn up in the listings after it is done.
+ */
+static ngx_int_t
+ngx_http_responsiveindex_dir_sizes(ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf, ngx_array_t *entries)
+{
+	u_char									*last;
+	size_t									root;
+	time_t									now;
+	ngx_str_t								path;
+	ngx_uint_t								i, locked;
+	ngx_array_t								walks;
+	ngx_http_responsiveindex_entry_t		*entry, **walk;
+	ngx_http_responsiveindex_cache_t		*cache;
+	ngx_http_responsiveindex_size_node_t	*node;
+
+	if (ngx_array_init(&walks, r->pool, 4, sizeof(ngx_http_responsiveindex_entry_t *))
+			!= NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	cache = conf->dir_size->data;
+	entry = entries->elts;
+	now = ngx_time();
+
+	locked = 0;
+
+	for (i = 0; i < entries->nelts; i++) {
+
+		/* Other workers get a turn between chunks of a long listing. */
+		if (i % NGX_HTTP_RESPONSIVEINDEX_SIZE_CHUNK == 0 && locked) {
+			ngx_shmtx_unlock(&cache->shpool->mutex);
+			locked = 0;
+		}
+
+		if (!entry[i].is_dir || entry[i].uniq == 0) {
+			continue;
+		}
+
+		if (!locked) {
+			ngx_shmtx_lock(&cache->shpool->mutex);
+			locked = 1;
+		}
+
+		node = ngx_http_responsiveindex_size_lookup(cache, entry[i].uniq, entry[i].dev);
+
+		if (node == NULL) {
+			if (walks.nelts == NGX_HTTP_RESPONSIVEINDEX_WALK_MAX) {
+				continue;
+			}
+
+			node = ngx_http_responsiveindex_size_alloc(cache, entry[i].uniq, entry[i].dev);
+			if (node == NULL) {
+				continue;
+			}
+
+		} else {
+			ngx_queue_remove(&node->queue);
+			ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+			/* Totals past responsiveindex_dir_size_valid are shown while they are redone. */
+			if (node->walked && node->mtime == entry[i].mtime) {
+				entry[i].sized = 1;
+				entry[i].size = node->size;
+				entry[i].files = node->files;
+
+				if (now - node->walked < conf->dir_size_valid) {
+					continue;
+				}
+			}
+		}
+
+		if (walks.nelts == NGX_HTTP_RESPONSIVEINDEX_WALK_MAX
+			|| (node->walking && now - node->walking <= NGX_HTTP_RESPONSIVEINDEX_WALK_TIMEOUT))
+		{
+			continue;
+		}
+
+		walk = ngx_array_push(&walks);
+		if (walk == NULL) {
+			ngx_shmtx_unlock(&cache->shpool->mutex);
+			return NGX_ERROR;
+		}
+
+		*walk = &entry[i];
+		node->walking = now;
+	}
+
+	if (locked) {
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+	}
+
+	if (walks.nelts == 0) {
+		return NGX_OK;
+	}
+
+	last = ngx_http_map_uri_to_path(r, &path, &root, 0);
+	if (last == NULL) {
+		return NGX_ERROR;
+	}
+
+	path.len = last - path.data;
+	if (path.len > 1) {
+		path.len--;
+	}
+
+	walk = walks.elts;
+
+	for (i = 0; i < walks.nelts; i++) {
+		/* One that cannot be started is retried once it times out. */
+		(void) ngx_http_responsiveindex_walk(conf, &path, walk[i]);
+	}
+
+	return NGX_OK;
+}
+
+
+/* Finds the totals of the directory with the given inode and device. Called with the zone locked. */
+static ngx_http_responsiveindex_size_node_t *
+ngx_http_responsiveindex_size_lookup(ngx_http_responsiveindex_cache_t *cache,
+		ngx_file_uniq_t uniq, dev_t dev)
+{
+	ngx_rbtree_key_t						key;
+	ngx_rbtree_node_t						*node, *sentinel;
+	ngx_http_responsiveindex_size_node_t	*sn;
+
+	key = (ngx_rbtree_key_t) uniq;
+
+	node = cache->sh->rbtree.root;
+	sentinel = cache->sh->rbtree.sentinel;
+
+	while (node != sentinel) {
+
+		if (key < node->key) {
+			node = node->left;
+			continue;
+		}
+
+		if (key > node->key) {
+			node = node->right;
+			continue;
+		}
+
+		/* key == node->key */
+
+		sn = (ngx_http_responsiveindex_size_node_t *) node;
+
+		if (dev == sn->dev) {
+			return sn;
+		}
+
+		node = (dev < sn->dev) ? node->left : node->right;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Adds an empty node for the directory with the given inode and device,
+ * evicting the least recently used ones to make room. Called with the
+ * zone locked.
+ */
+static ngx_http_responsiveindex_size_node_t *
+ngx_http_responsiveindex_size_alloc(ngx_http_responsiveindex_cache_t *cache,
+		ngx_file_uniq_t uniq, dev_t dev)
+{
+	ngx_queue_t								*q;
+	ngx_http_responsiveindex_size_node_t	*node, *old;
+
+	for ( ;; ) {
+		node = ngx_slab_alloc_locked(cache->shpool,
+				sizeof(ngx_http_responsiveindex_size_node_t));
+		if (node) {
+			break;
+		}
+
+		if (ngx_queue_empty(&cache->sh->queue)) {
+			return NULL;
+		}
+
+		q = ngx_queue_last(&cache->sh->queue);
+		old = ngx_queue_data(q, ngx_http_responsiveindex_size_node_t, queue);
+
+		ngx_queue_remove(q);
+		ngx_rbtree_delete(&cache->sh->rbtree, &old->node);
+		ngx_slab_free_locked(cache->shpool, old);
+	}
+
+	ngx_memzero(node, sizeof(ngx_http_responsiveindex_size_node_t));
+
+	node->node.key = (ngx_rbtree_key_t) uniq;
+	node->dev = dev;
+
+	ngx_rbtree_insert(&cache->sh->rbtree, &node->node);
+	ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+	return node;
+}
+
+
+/* Posts a walk of the tree of one directory of the listing at path. */
+static ngx_int_t
+ngx_http_responsiveindex_walk(ngx_http_responsiveindex_loc_conf_t *conf, ngx_str_t *path,
+		ngx_http_responsiveindex_entry_t *entry)
+{
+	u_char							*p;
+	ngx_pool_t						*pool;
+	ngx_thread_task_t				*task;
+	ngx_http_responsiveindex_walk_t	*walk;
+
+	/* The walk outlives the request, so it gets a pool of its own. */
+	pool = ngx_create_pool(512, ngx_cycle->log);
+	if (pool == NULL) {
+		return NGX_ERROR;
+	}
+
+	task = ngx_thread_task_alloc(pool, sizeof(ngx_http_responsiveindex_walk_t));
+	if (task == NULL) {
+		goto failed;
+	}
+
+	walk = task->ctx;
+
+	walk->zone = conf->dir_size;
+	walk->pool = pool;
+	walk->uniq = entry->uniq;
+	walk->dev = entry->dev;
+	walk->mtime = entry->mtime;
+
+	walk->path.len = path->len + 1 + entry->name.len;
+	walk->path.data = ngx_pnalloc(pool, walk->path.len + 1);
+	if (walk->path.data == NULL) {
+		goto failed;
+	}
+
+	p = ngx_cpymem(walk->path.data, path->data, path->len);
+	*p++ = '/';
+	ngx_cpystrn(p, entry->name.data, entry->name.len + 1);
+
+	task->handler = ngx_http_responsiveindex_walk_thread;
+	task->event.handler = ngx_http_responsiveindex_walk_done;
+	task->event.data = walk;
+
+	if (ngx_thread_task_post(conf->thread_pool, task) != NGX_OK) {
+		goto failed;
+	}
+
+	return NGX_OK;
+
+failed:
+
+	ngx_destroy_pool(pool);
+
+	return NGX_ERROR;
+}
+
+
+/*
+ * Runs on the thread pool: adds up the regular files of the tree, hidden
+ * ones included, the way du(1) would. Symlinks are not followed.
+ */
+static void
+ngx_http_responsiveindex_walk_thread(void *data, ngx_log_t *log)
+{
+	ngx_http_responsiveindex_walk_t  *walk = data;
+
+	ngx_tree_ctx_t  tree;
+
+	tree.init_handler = NULL;
+	tree.file_handler = ngx_http_responsiveindex_walk_file;
+	tree.pre_tree_handler = ngx_http_responsiveindex_walk_noop;
+	tree.post_tree_handler = ngx_http_responsiveindex_walk_noop;
+	tree.spec_handler = ngx_http_responsiveindex_walk_noop;
+	tree.data = walk;
+	tree.alloc = 0;
+	tree.log = log;
+
+	walk->rc = ngx_walk_tree(&tree, &walk->path);
+}
+
+
+static ngx_int_t
+ngx_http_responsiveindex_walk_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+	ngx_http_responsiveindex_walk_t  *walk = ctx->data;
+
+	walk->size += ctx->size;
+	walk->files++;
+
+	return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_responsiveindex_walk_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+	return NGX_OK;
+}
+
+
+/* Back in the worker: stores the totals of a walk. */
+static void
+ngx_http_responsiveindex_walk_done(ngx_event_t *ev)
+{
+	ngx_http_responsiveindex_walk_t			*walk;
+	ngx_http_responsiveindex_cache_t		*cache;
+	ngx_http_responsiveindex_size_node_t	*node;
+
+	walk = ev->data;
+	cache = walk->zone->data;
+
+	ngx_log_debug4(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+			"http responsiveindex walk: \"%V\" %i, %O bytes in %ui files",
+			&walk->path, walk->rc, walk->size, walk->files);
+
+	/* A failed walk is left marked as running, so it is only retried once it times out. */
+	if (walk->rc == NGX_OK) {
+		ngx_shmtx_lock(&cache->shpool->mutex);
+
+		node = ngx_http_responsiveindex_size_lookup(cache, walk->uniq, walk->dev);
+
+		if (node == NULL) {
+			node = ngx_http_responsiveindex_size_alloc(cache, walk->uniq, walk->dev);
+		}
+
+		if (node) {
+			node->mtime = walk->mtime;
+			node->walked = ngx_time();
+			node->walking = 0;
+			node->size = walk->size;
+			node->files = walk->files;
+		}
+
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+	}
+
+	ngx_destroy_pool(walk->pool);
+}
+
+
+/*
+ * Sorts a listing the scan left unsorted: every shard is sorted on the
+ * thread pool, then neighbouring runs are merged in pairs, a round at a
+ * time, until one is left. Returns NGX_OK if that could be done right
+ * away, NGX_DONE if scan->done is called again once it is, or NGX_ERROR.
+ */
+static ngx_int_t
+ngx_http_responsiveindex_sort(ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf, ngx_http_responsiveindex_scan_t *scan)
+{
+	ngx_array_t							*entries;
+	ngx_http_responsiveindex_parallel_t	*pl;
+
+	entries = &scan->listing.entries;
+
+	pl = ngx_http_responsiveindex_parallel(r, conf, entries->elts, entries->nelts);
+	if (pl == NULL) {
+		return NGX_ERROR;
+	}
+
+	pl->scan = scan;
+
+	pl->spare = ngx_palloc(r->pool, entries->nelts * sizeof(ngx_http_responsiveindex_entry_t));
+	if (pl->spare == NULL) {
+		return NGX_ERROR;
+	}
+
+	ngx_http_responsiveindex_parallel_run(pl, ngx_http_responsiveindex_sort_thread,
+			ngx_http_responsiveindex_merge);
+
+	return pl->rc == NGX_AGAIN ? NGX_DONE : pl->rc;
+}
+
+
+static void
+ngx_http_responsiveindex_sort_thread(void *data, ngx_log_t *log)
+{
+	ngx_http_responsiveindex_shard_t  *shard = data;
+
+	ngx_qsort(shard->entry, (size_t) shard->nelts, sizeof(ngx_http_responsiveindex_entry_t),
+			ngx_http_responsiveindex_cmp_entries);
+}
+
+
+/* Starts the next round of merges, or hands the listing on once it is a single run. */
+static void
+ngx_http_responsiveindex_merge(ngx_http_responsiveindex_parallel_t *pl)
+{
+	ngx_uint_t							i, n, na, nb;
+	ngx_array_t							*entries;
+	ngx_http_responsiveindex_entry_t	*base, *a, *b;
+	ngx_http_responsiveindex_shard_t	*shard;
+
+	shard = pl->shards;
+
+	if (pl->nshards > 1) {
+
+		/* The runs lie side by side, so each pair goes to the same place in the other buffer. */
+
+		base = shard[0].entry;
+		n = (pl->nshards + 1) / 2;
+
+		for (i = 0; i < n; i++) {
+			a = shard[2 * i].entry;
+			na = shard[2 * i].nelts;
+
+			if (2 * i + 1 < pl->nshards) {
+				b = shard[2 * i + 1].entry;
+				nb = shard[2 * i + 1].nelts;
+
+			} else {
+				/* The odd one out is merged with nothing. */
+				b = a + na;
+				nb = 0;
+			}
+
+			shard[i].entry = a;
+			shard[i].nelts = na;
+			shard[i].next = b;
+			shard[i].next_nelts = nb;
+			shard[i].out = pl->spare + (a - base);
+		}
+
+		pl->spare = base;
+		pl->nshards = n;
+
+		ngx_http_responsiveindex_parallel_run(pl, ngx_http_responsiveindex_merge_thread,
+				ngx_http_responsiveindex_merge);
+		return;
+	}
+
+	entries = &pl->scan->listing.entries;
+
+	if (shard[0].entry != entries->elts) {
+		entries->elts = shard[0].entry;
+		entries->nalloc = entries->nelts;
+	}
+
+	pl->scan->unsorted = 0;
+	pl->rc = NGX_OK;
+
+	if (pl->async) {
+		pl->scan->done(pl->scan, NGX_OK);
+	}
+}
+
+
+/* Merges a shard's run with the one after it, taking the first on ties. */
+static void
+ngx_http_responsiveindex_merge_thread(void *data, ngx_log_t *log)
+{
+	ngx_http_responsiveindex_shard_t  *shard = data;
+
+	ngx_http_responsiveindex_entry_t	*a, *b, *ea, *eb, *out;
+
+	a = shard->entry;
+	ea = a + shard->nelts;
+	b = shard->next;
+	eb = b + shard->next_nelts;
+	out = shard->out;
+
+	while (a < ea && b < eb) {
+		if (ngx_http_responsiveindex_cmp_entries(b, a) < 0) {
+			*out++ = *b++;
+
+		} else {
+			*out++ = *a++;
+		}
+	}
+
+	ngx_memcpy(out, a, (ea - a) * sizeof(ngx_http_responsiveindex_entry_t));
+	out += ea - a;
+
+	ngx_memcpy(out, b, (eb - b) * sizeof(ngx_http_responsiveindex_entry_t));
+
+	shard->entry = shard->out;
+	shard->nelts += shard->next_nelts;
+}
+
+
+/*
+ * Renders the HTML of a listing a shard per thread: each shard works out
+ * the sizes of its rows and list items, and renders them into a buffer of
+ * its own. The buffers go out in order, in one chain.
+ */
+static ngx_int_t
+ngx_http_responsiveindex_render(ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf, ngx_array_t *entries)
+{
+	ngx_uint_t							i;
+	ngx_time_t							*tp;
+	ngx_pool_cleanup_t					*cln;
+	ngx_http_responsiveindex_parallel_t	*pl;
+
+	pl = ngx_http_responsiveindex_parallel(r, conf, entries->elts, entries->nelts);
+	if (pl == NULL) {
+		return NGX_ERROR;
+	}
+
+	for (i = 0; i < pl->nshards; i++) {
+		pl->shards[i].rows = ngx_calloc_buf(r->pool);
+		pl->shards[i].items = ngx_calloc_buf(r->pool);
+
+		if (pl->shards[i].rows == NULL || pl->shards[i].items == NULL) {
+			return NGX_ERROR;
+		}
+	}
+
+	cln = ngx_pool_cleanup_add(r->pool, 0);
+	if (cln == NULL) {
+		return NGX_ERROR;
+	}
+
+	cln->handler = ngx_http_responsiveindex_render_cleanup;
+	cln->data = pl;
+
+	pl->utf8 = ngx_http_responsiveindex_utf8(r);
+
+	tp = ngx_timeofday();
+	pl->gmtoff = tp->gmtoff * 60 * conf->localtime;
+
+	ngx_http_responsiveindex_parallel_run(pl, ngx_http_responsiveindex_render_thread,
+			ngx_http_responsiveindex_rendered);
+
+	if (pl->rc != NGX_AGAIN) {
+		return pl->rc;
+	}
+
+	r->main->count++;
+
+	return NGX_DONE;
+}
+
+
+static void
+ngx_http_responsiveindex_render_thread(void *data, ngx_log_t *log)
+{
+	ngx_http_responsiveindex_shard_t  *shard = data;
+
+	size_t								rows, items;
+	ngx_buf_t							*b;
+	ngx_http_responsiveindex_parallel_t	*pl;
+
+	pl = shard->parallel;
+
+	ngx_http_responsiveindex_html_sizes(shard->entry, shard->nelts, pl->utf8,
+			&rows, &items);
+
+	/* Freed by ngx_http_responsiveindex_render_cleanup(): the request pool is not for threads. */
+	shard->start = ngx_alloc(rows + items, log);
+	if (shard->start == NULL) {
+		return;
+	}
+
+	b = shard->rows;
+	b->start = shard->start;
+	b->pos = b->start;
+	b->last = b->start;
+	b->temporary = 1;
+
+	ngx_http_responsiveindex_html_rows(b, pl->conf, shard->entry, shard->nelts, pl->gmtoff);
+
+	b->end = b->last;
+
+	b = shard->items;
+	b->start = shard->rows->end;
+	b->pos = b->start;
+	b->last = b->start;
+	b->temporary = 1;
+
+	ngx_http_responsiveindex_html_items(b, shard->entry, shard->nelts);
+
+	b->end = b->last;
+}
+
+
+/* Sends the head of the page, the rows and list items of every shard, and the end. */
+static void
+ngx_http_responsiveindex_rendered(ngx_http_responsiveindex_parallel_t *pl)
+{
+	ngx_int_t			rc;
+	ngx_uint_t			i, n;
+	ngx_buf_t			**bufs, *b;
+	ngx_chain_t			*out, **ll, *cl;
+	ngx_http_request_t	*r;
+
+	r = pl->request;
+	rc = NGX_ERROR;
+
+	for (i = 0; i < pl->nshards; i++) {
+		if (pl->shards[i].start == NULL) {
+			goto done;
+		}
+	}
+
+	bufs = ngx_palloc(r->pool, (2 * pl->nshards + 3) * sizeof(ngx_buf_t *));
+	if (bufs == NULL) {
+		goto done;
+	}
+
+	n = 0;
+
+	b = ngx_create_temp_buf(r->pool, ngx_http_responsiveindex_html_head(NULL, r, pl->conf));
+	if (b == NULL) {
+		goto done;
+	}
+
+	b->last += ngx_http_responsiveindex_html_head(b->last, r, pl->conf);
+	bufs[n++] = b;
+
+	for (i = 0; i < pl->nshards; i++) {
+		bufs[n++] = pl->shards[i].rows;
+	}
+
+	b = ngx_calloc_buf(r->pool);
+	if (b == NULL) {
+		goto done;
+	}
+
+	b->pos = to_list.data;
+	b->last = to_list.data + to_list.len;
+	b->memory = 1;
+	bufs[n++] = b;
+
+	for (i = 0; i < pl->nshards; i++) {
+		bufs[n++] = pl->shards[i].items;
+	}
+
+	b = ngx_calloc_buf(r->pool);
+	if (b == NULL) {
+		goto done;
+	}
+
+	b->pos = to_html_end.data;
+	b->last = to_html_end.data + to_html_end.len;
+	b->memory = 1;
+
+	/* Last buffer in chain. */
+	if (r == r->main) {
+		b->last_buf = 1;
+	}
+
+	b->last_in_chain = 1;
+	bufs[n++] = b;
+
+	ll = &out;
+
+	for (i = 0; i < n; i++) {
+		cl = ngx_alloc_chain_link(r->pool);
+		if (cl == NULL) {
+			goto done;
+		}
+
+		cl->buf = bufs[i];
+		*ll = cl;
+		ll = &cl->next;
+	}
+
+	*ll = NULL;
+
+	rc = ngx_http_output_filter(r, out);
+
+done:
+
+	pl->rc = rc;
+
+	if (pl->async) {
+		ngx_http_finalize_request(r, rc);
+	}
+}
+
+
+static void
+ngx_http_responsiveindex_render_cleanup(void *data)
+{
+	ngx_http_responsiveindex_parallel_t  *pl = data;
+
+	ngx_uint_t  i;
+
+	for (i = 0; i < pl->nshards; i++) {
+		if (pl->shards[i].start) {
+			ngx_free(pl->shards[i].start);
+		}
+	}
+}
+
+
+/* Splits nelts entries into responsiveindex_parallel_shards shards, each with its task. */
+static ngx_http_responsiveindex_parallel_t *
+ngx_http_responsiveindex_parallel(ngx_http_request_t *r,
+		ngx_http_responsiveindex_loc_conf_t *conf, ngx_http_responsiveindex_entry_t *entry,
+		ngx_uint_t nelts)
+{
+	ngx_uint_t							i, n;
+	ngx_thread_task_t					*task;
+	ngx_http_responsiveindex_shard_t	*shard;
+	ngx_http_responsiveindex_parallel_t	*pl;
+
+	pl = ngx_pcalloc(r->pool, sizeof(ngx_http_responsiveindex_parallel_t));
+	if (pl == NULL) {
+		return NULL;
+	}
+
+	pl->request = r;
+	pl->conf = conf;
+	pl->rc = NGX_AGAIN;
+	pl->nshards = ngx_min(conf->parallel_shards, nelts);
+
+	pl->shards = ngx_pcalloc(r->pool,
+			pl->nshards * sizeof(ngx_http_responsiveindex_shard_t));
+	if (pl->shards == NULL) {
+		return NULL;
+	}
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"http responsiveindex parallel: %ui entries in %ui shards",
+			nelts, pl->nshards);
+
+	for (i = 0; i < pl->nshards; i++) {
+		shard = &pl->shards[i];
+
+		/* The first nelts % nshards shards take one more. */
+		n = nelts / pl->nshards + (i < nelts % pl->nshards);
+
+		shard->parallel = pl;
+		shard->entry = entry;
+		shard->nelts = n;
+
+		entry += n;
+
+		task = ngx_thread_task_alloc(r->pool, 0);
+		if (task == NULL) {
+			return NULL;
+		}
+
+		task->ctx = shard;
+		task->event.handler = ngx_http_responsiveindex_parallel_handler;
+		task->event.data = shard;
+
+		shard->task = task;
+	}
+
+	return pl;
+}
+
+
+/*
+ * Runs handler for every shard on the thread pool, and done once they
+ * are all through. A shard the pool has no room for is done right here.
+ */
+static void
+ngx_http_responsiveindex_parallel_run(ngx_http_responsiveindex_parallel_t *pl,
+		void (*handler)(void *data, ngx_log_t *log), ngx_http_responsiveindex_parallel_pt done)
+{
+	ngx_uint_t			i;
+	ngx_thread_task_t	*task;
+	ngx_http_request_t	*r;
+
+	r = pl->request;
+
+	pl->done = done;
+	pl->pending = 0;
+
+	for (i = 0; i < pl->nshards; i++) {
+		task = pl->shards[i].task;
+		task->handler = handler;
+
+		if (ngx_thread_task_post(pl->conf->parallel_pool, task) == NGX_OK) {
+			pl->pending++;
+			continue;
+		}
+
+		handler(&pl->shards[i], r->connection->log);
+	}
+
+	if (pl->pending) {
+		r->main->blocked++;
+		return;
+	}
+
+	done(pl);
+}
+
+
+static void
+ngx_http_responsiveindex_parallel_handler(ngx_event_t *ev)
+{
+	ngx_connection_t					*c;
+	ngx_http_request_t					*r;
+	ngx_http_responsiveindex_shard_t	*shard;
+	ngx_http_responsiveindex_parallel_t	*pl;
+
+	shard = ev->data;
+	pl = shard->parallel;
+	r = pl->request;
+	c = r->connection;
+
+	if (--pl->pending) {
+		return;
+	}
+
+	r->main->blocked--;
+
+	/* Whoever started this has returned by now, so the rest is up to done. */
+	pl->async = 1;
+
+	if (c->error) {
+		/* The request was cut short meanwhile, and only waited for the threads. */
+		ngx_http_finalize_request(r, NGX_ERROR);
+
+	} else {
+		pl->done(pl);
+	}
+
+	ngx_http_run_posted_requests(c);
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_responsiveindex_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+	ngx_http_responsiveindex_cache_t  *ocache = data;
+
+	size_t							len;
+	ngx_http_responsiveindex_cache_t	*cache;
+
+	cache = shm_zone->data;
+
+	if (ocache) {
+		cache->sh = ocache->sh;
+		cache->shpool = ocache->shpool;
+		return NGX_OK;
+	}
+
+	cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+	if (shm_zone->shm.exists) {
+		cache->sh = cache->shpool->data;
+		return NGX_OK;
+	}
+
+	cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_responsiveindex_cache_sh_t));
+	if (cache->sh == NULL) {
+		return NGX_ERROR;
+	}
+
+	cache->shpool->data = cache->sh;
+
+	/* Listings are found by path, directory totals by inode and device. */
+	if (shm_zone->tag == &ngx_http_responsiveindex_dir_size_tag) {
+		ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+				ngx_http_responsiveindex_size_insert_value);
+
+	} else {
+		ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+				ngx_str_rbtree_insert_value);
+	}
+
+	ngx_queue_init(&cache->sh->queue);
+
+	cache->sh->generation = 0;
+
+	len = sizeof(" in responsiveindex zone \"\"") + shm_zone->shm.name.len;
+
+	cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+	if (cache->shpool->log_ctx == NULL) {
+		return NGX_ERROR;
+	}
+
+	ngx_sprintf(cache->shpool->log_ctx, " in responsiveindex zone \"%V\"%Z",
+			&shm_zone->shm.name);
+
+	/* A full zone is expected; the least recently used listings make room. */
+	cache->shpool->log_nomem = 0;
+
+	return NGX_OK;
+}
+
+
+static char *
+ngx_http_responsiveindex_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	u_char							*p;
+	ssize_t							size;
+	ngx_str_t						*value, name, s;
+	ngx_shm_zone_t					*shm_zone;
+	ngx_http_responsiveindex_cache_t	*cache;
+
+	value = cf->args->elts;
+
+	/* name:size */
+	p = (u_char *) ngx_strchr(value[1].data, ':');
+
+	if (p == NULL || p == value[1].data) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"invalid zone \"%V\"", &value[1]);
+		return NGX_CONF_ERROR;
+	}
+
+	name.data = value[1].data;
+	name.len = p - value[1].data;
+
+	s.data = p + 1;
+	s.len = value[1].data + value[1].len - s.data;
+
+	size = ngx_parse_size(&s);
+
+	if (size == NGX_ERROR) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"invalid zone size \"%V\"", &value[1]);
+		return NGX_CONF_ERROR;
+	}
+
+	if (size < (ssize_t) (8 * ngx_pagesize)) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"zone \"%V\" is too small", &value[1]);
+		return NGX_CONF_ERROR;
+	}
+
+	cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_responsiveindex_cache_t));
+	if (cache == NULL) {
+		return NGX_CONF_ERROR;
+	}
+
+	shm_zone = ngx_shared_memory_add(cf, &name, size,
+			cmd->post ? cmd->post : &ngx_http_responsiveindex_module);
+	if (shm_zone == NULL) {
+		return NGX_CONF_ERROR;
+	}
+
+	if (shm_zone->data) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"duplicate zone \"%V\"", &name);
+		return NGX_CONF_ERROR;
+	}
+
+	shm_zone->init = ngx_http_responsiveindex_cache_init_zone;
+	shm_zone->data = cache;
+
+	return NGX_CONF_OK;
+}
+
+
+/* Sets the zone of responsiveindex_cache, or of responsiveindex_dir_size. */
+static char *
+ngx_http_responsiveindex_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	char  *p = conf;
+
+	ngx_str_t		*value;
+	ngx_shm_zone_t	**zone;
+
+	zone = (ngx_shm_zone_t **) (p + cmd->offset);
+
+	if (*zone != NGX_CONF_UNSET_PTR) {
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	if (ngx_strcmp(value[1].data, "off") == 0) {
+		*zone = NULL;
+		return NGX_CONF_OK;
+	}
+
+	/* The zone itself may be declared later; a zone of the other kind is an error. */
+	*zone = ngx_shared_memory_add(cf, &value[1], 0,
+			cmd->post ? cmd->post : &ngx_http_responsiveindex_module);
+	if (*zone == NULL) {
+		return NGX_CONF_ERROR;
+	}
+
+	return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_responsiveindex_stylesheet(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_core_loc_conf_t  *clcf;
+
+	clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+	clcf->handler = ngx_http_responsiveindex_css_handler;
+
+	return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_responsiveindex_io_uring(ngx_conf_t *cf, void *post, void *data)
+{
+#if !(NGX_HAVE_IO_URING_STATX)
+
+	ngx_flag_t  *fp = data;
+
+	if (*fp) {
+		ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+				"\"responsiveindex_io_uring\" is not supported by this build, "
+				"entries are stat()ed one by one");
+	}
+
+#endif
+
+	return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_responsiveindex_filter(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_PCRE)
+	char  *p = conf;
+
+	ngx_str_t	*value, *pattern;
+	ngx_uint_t	i;
+	ngx_array_t	**patterns;
 
-	/* Close the directory. */
-	if (ngx_close_dir(&dir) == NGX_ERROR) {
-		ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
-				ngx_close_dir_n " \"%V\" failed", &path);
+	patterns = (ngx_array_t **) (p + cmd->offset);
+
+	if (*patterns == NULL) {
+		*patterns = ngx_array_create(cf->pool, 4, sizeof(ngx_str_t));
+		if (*patterns == NULL) {
+			return NGX_CONF_ERROR;
+		}
 	}
 
-	escape_html = ngx_escape_html(NULL, r->uri.data, r->uri.len);
+	value = cf->args->elts;
 
-	/* We need to calculate the size of the buffer. */
+	for (i = 1; i < cf->args->nelts; i++) {
+		if (value[i].len == 0
+				|| (value[i].data[0] == '~' && value[i].len == 1)
+				|| (value[i].len == 2 && ngx_strncmp(value[i].data, "~*", 2) == 0))
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid pattern \"%V\"", &value[i]);
+			return NGX_CONF_ERROR;
+		}
 
-	response_size = r->uri.len + escape_html
-		+ r->uri.len + escape_html
-		+ to_lang.len
-		+ to_stylesheet.len
-		+ to_title.len
-		+ to_h1.len
-		+ to_table_body.len
-		;
+		pattern = ngx_array_push(*patterns);
+		if (pattern == NULL) {
+			return NGX_CONF_ERROR;
+		}
 
-	if (conf->lang.len) {
-		response_size += conf->lang.len;
-	} else {
-		response_size += en.len;
+		*pattern = value[i];
 	}
 
+	return NGX_CONF_OK;
 
-	if (conf->bootstrap_href.len) {
-		response_size += conf->bootstrap_href.len;
-	} else {
-		response_size += bootstrapcdn.len;
-	}
+#else
 
-	/* Add a table with each file. */
-	entry = entries.elts;
-	for (i = 0; i < entries.nelts; i++) {
-		response_size += entry[i].name.len + entry[i].escape
+	ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"\"%V\" requires PCRE library", &cmd->name);
+	return NGX_CONF_ERROR;
 
-			/* 1 is for "/" */
-			+ 1
+#endif
+}
 
-			+ to_td_href.len
-			+ tag_end.len
-			+ entry[i].name.len - entry[i].utf_len
-			+ entry[i].escape_html
-			+ entry[i].name.len
-			+ to_td_date.len
-			+ sizeof("28-Sep-1970 12:00") - 1
-			+ to_td_size.len
 
-			/* the file size */
-			+ 20
+#if (NGX_PCRE)
 
-			+ end_row.len
-			;
-	}
+/*
+ * Compiles a list of patterns into one regex matching any of them, so a
+ * name is checked with a single ngx_regex_exec call. Patterns starting
+ * with "~" (or "~*" for caseless) are regexes, anything else is a glob
+ * matched against the whole name. Each goes in as a group of its own,
+ * and a regex is compiled alone first, both as given and as that group,
+ * so one cannot change what the others match.
+ */
+static ngx_regex_t *
+ngx_http_responsiveindex_compile(ngx_conf_t *cf, ngx_array_t *patterns)
+{
+	u_char				*p, *s, *end, *close, *group;
+	size_t				len;
+	ngx_str_t			*pattern, re;
+	ngx_uint_t			i;
+	ngx_regex_compile_t	rc;
+	u_char				errstr[NGX_MAX_CONF_ERRSTR];
 
-	response_size += to_list.len;
+	pattern = patterns->elts;
 
-	for (i = 0; i < entries.nelts; i++) {
-		response_size += entry[i].name.len + entry[i].escape
-			+ to_item_href.len
-			+ tag_end.len
-			+ entry[i].name.len - entry[i].utf_len
-			+ entry[i].escape_html
-			+ entry[i].name.len
+	/* Escaping at most doubles a glob. */
+	len = 0;
 
-			/* 1 is for "/" */
-			+ 1
+	for (i = 0; i < patterns->nelts; i++) {
+		len += sizeof("|(?:(?i)^$)") - 1 + 2 * pattern[i].len;
+	}
 
-			+ sizeof("\">") - 1
-			+ to_item_end.len
-			;
+	ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+
+	rc.pattern.data = ngx_pnalloc(cf->pool, len);
+	if (rc.pattern.data == NULL) {
+		return NULL;
 	}
 
+	p = rc.pattern.data;
 
-	response_size += to_html_end.len;
+	for (i = 0; i < patterns->nelts; i++) {
+		s = pattern[i].data;
+		end = s + pattern[i].len;
 
-	/* Allocate a buffer for the response body based on the size we calculated. */
-	b = ngx_create_temp_buf(r->pool, response_size);
-	if (b == NULL) {
-		return NGX_ERROR;
-	}
+		if (i) {
+			*p++ = '|';
+		}
 
-	/* Sort the entries. */
-	if (entries.nelts > 1) {
-		ngx_qsort(entry, (size_t) entries.nelts,
-				sizeof(ngx_http_responsiveindex_entry_t),
-				ngx_http_responsiveindex_cmp_entries);
-	}
+		group = p;
 
-	/* Start adding data to the response. */
+		p = ngx_cpymem(p, "(?:", 3);
 
-	b->last = ngx_cpymem(b->last, to_lang.data, to_lang.len);
+		if (s[0] == '~') {
+			s++;
 
-	if (conf->lang.len) {
-		b->last = ngx_cpymem(b->last, conf->lang.data, conf->lang.len);
-	} else {
-		b->last = ngx_cpymem(b->last, en.data, en.len);
-	}
+			if (s[0] == '*') {
+				s++;
+				p = ngx_cpymem(p, "(?i)", 4);
+			}
 
-	b->last = ngx_cpymem(b->last, to_stylesheet.data, to_stylesheet.len);
+			p = ngx_cpymem(p, s, end - s);
+			*p++ = ')';
 
-	if (conf->bootstrap_href.len) {
-		b->last = ngx_cpymem(b->last, conf->bootstrap_href.data, conf->bootstrap_href.len);
-	} else {
-		b->last = ngx_cpymem(b->last, bootstrapcdn.data, bootstrapcdn.len);
-	}
+			/* Group numbers change in the alternation, so nothing may refer to one. */
+			if (ngx_http_responsiveindex_backref(s, end)) {
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+						"backreferences are not supported in pattern \"%V\"",
+						&pattern[i]);
+				return NULL;
+			}
 
-	b->last = ngx_cpymem(b->last, to_title.data, to_title.len);
+			/*
+			 * Alone, an unbalanced ")" fails, and as a group, so does a
+			 * "\Q" or "#" comment running over the closing ")".
+			 */
 
-	if (escape_html) {
-		b->last = (u_char *) ngx_escape_html(b->last, r->uri.data, r->uri.len);
-		b->last = ngx_cpymem(b->last, to_h1.data, to_h1.len);
-		b->last = (u_char *) ngx_escape_html(b->last, r->uri.data, r->uri.len);
-	} else {
-		b->last = ngx_cpymem(b->last, r->uri.data, r->uri.len);
-		b->last = ngx_cpymem(b->last, to_h1.data, to_h1.len);
-		b->last = ngx_cpymem(b->last, r->uri.data, r->uri.len);
-	}
+			re.len = end - s;
+			re.data = s;
 
-	b->last = ngx_cpymem(b->last, to_table_body.data, to_table_body.len);
+			if (ngx_http_responsiveindex_regex(cf, &re, &pattern[i]) != NGX_OK) {
+				return NULL;
+			}
 
-	tp = ngx_timeofday();
+			re.len = p - group;
+			re.data = group;
 
-	for (i = 0; i < entries.nelts; i++) {
+			if (ngx_http_responsiveindex_regex(cf, &re, &pattern[i]) != NGX_OK) {
+				return NULL;
+			}
 
-		b->last = ngx_cpymem(b->last, to_td_href.data, to_td_href.len);
+			continue;
+		}
 
-		ngx_http_responsiveindex_cpy_uri(b, &entry[i]);
+		*p++ = '^';
 
-		b->last = ngx_cpymem(b->last, tag_end.data, tag_end.len);
+		for ( /* void */ ; s < end; s++) {
 
-		b->last = ngx_cpymem(b->last, entry[i].name.data, entry[i].name.len);
+			switch (*s) {
 
-		b->last = ngx_cpymem(b->last, to_td_date.data, to_td_date.len);
+			case '*':
+				*p++ = '.';
+				*p++ = '*';
+				break;
 
-		ngx_gmtime(entry[i].mtime + tp->gmtoff * 60 * conf->localtime, &tm);
+			case '?':
+				*p++ = '.';
+				break;
 
+			case '[':
 
-		b->last = ngx_sprintf(b->last, "%02d-%s-%d %02d:%02d ",
-				tm.ngx_tm_mday,
-				months[tm.ngx_tm_mon - 1],
-				tm.ngx_tm_year,
-				tm.ngx_tm_hour,
-				tm.ngx_tm_min);
+				/* A class runs to the next ']', not counting one right after "[" or "[!". */
 
-		b->last = ngx_cpymem(b->last, to_td_size.data, to_td_size.len);
+				close = s + 1;
 
-		ngx_http_responsiveindex_cpy_size(b, &entry[i], conf);
+				if (close < end && *close == '!') {
+					close++;
+				}
 
-		b->last = ngx_cpymem(b->last, end_row.data, end_row.len);
-	}
+				if (close < end && *close == ']') {
+					close++;
+				}
 
-	b->last = ngx_cpymem(b->last, to_list.data, to_list.len);
+				while (close < end && *close != ']') {
+					close++;
+				}
 
-	for (i = 0; i < entries.nelts; i++) {
-		b->last = ngx_cpymem(b->last, to_item_href.data,to_item_href.len);
+				if (close == end) {
+					*p++ = '\\';
+					*p++ = '[';
+					break;
+				}
 
-		ngx_http_responsiveindex_cpy_uri(b, &entry[i]);
+				*p++ = '[';
+				s++;
 
-		b->last = ngx_cpymem(b->last, tag_end.data, tag_end.len);
+				if (*s == '!') {
+					*p++ = '^';
+					s++;
+				}
 
-		b->last = ngx_cpymem(b->last, entry[i].name.data, entry[i].name.len);
+				while (s < close) {
+					if (*s == '\\') {
+						*p++ = '\\';
+					}
 
-		b->last = ngx_cpymem(b->last, to_item_end.data, to_item_end.len);
+					*p++ = *s++;
+				}
 
-	}
+				*p++ = ']';
+				break;
 
-	b->last = ngx_cpymem(b->last, to_html_end.data, to_html_end.len);
+			case '\\': case '^': case '$': case '.': case '|':
+			case '+': case '(': case ')': case '{': case '}': case ']':
+				*p++ = '\\';
+				*p++ = *s;
+				break;
 
-	/* TODO: free temporary pool */
+			default:
+				*p++ = *s;
+			}
+		}
 
-	/* Last buffer in chain. */
-	if (r == r->main) {
-		b->last_buf = 1;
+		*p++ = '$';
+		*p++ = ')';
 	}
 
-	b->last_in_chain = 1;
+	rc.pattern.len = p - rc.pattern.data;
 
-	/* Attach this buffer to the buffer chain. */
-	out.buf = b;
-	out.next = NULL;
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+			"http responsiveindex filter: \"%V\"", &rc.pattern);
 
-	/* Send the buffer chain of the response. */
-	return ngx_http_output_filter(r, &out);
+	rc.pool = cf->pool;
+	rc.err.len = NGX_MAX_CONF_ERRSTR;
+	rc.err.data = errstr;
+
+	if (ngx_regex_compile(&rc) != NGX_OK) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V", &rc.err);
+		return NULL;
+	}
+
+	return rc.regex;
 }
 
 
-static int ngx_libc_cdecl
-ngx_http_responsiveindex_cmp_entries(const void *one, const void *two)
+/* Compiles a regex on its own, only to see that it does compile. */
+static ngx_int_t
+ngx_http_responsiveindex_regex(ngx_conf_t *cf, ngx_str_t *re, ngx_str_t *pattern)
 {
-	ngx_http_responsiveindex_entry_t *first = (ngx_http_responsiveindex_entry_t *) one;
-	ngx_http_responsiveindex_entry_t *second = (ngx_http_responsiveindex_entry_t *) two;
+	ngx_regex_compile_t	rc;
+	u_char				errstr[NGX_MAX_CONF_ERRSTR];
 
-	if (first->is_dir && !second->is_dir) {
-		/* move the directories to the start */
-		return -1;
-	}
+	ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
 
-	if (!first->is_dir && second->is_dir) {
-		/* move the directories to the start */
-		return 1;
+	rc.pattern = *re;
+	rc.pool = cf->pool;
+	rc.err.len = NGX_MAX_CONF_ERRSTR;
+	rc.err.data = errstr;
+
+	if (ngx_regex_compile(&rc) != NGX_OK) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V in pattern \"%V\"",
+				&rc.err, pattern);
+		return NGX_ERROR;
 	}
 
-	return (int) ngx_strcmp(first->name.data, second->name.data);
+	return NGX_OK;
 }
 
 
-static ngx_int_t
-ngx_http_responsiveindex_error(ngx_http_request_t *r, ngx_dir_t *dir, ngx_str_t *name)
+/*
+ * Returns 1 if a regex refers to a group by number or name: "\1", "\g",
+ * "\k", "(?P=", a condition such as "(?(1)", or a call such as "(?1)",
+ * "(?R)", "(?&" or "(?P>".
+ */
+static ngx_uint_t
+ngx_http_responsiveindex_backref(u_char *p, u_char *end)
 {
-	if (ngx_close_dir(dir) == NGX_ERROR) {
-		ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
-				ngx_close_dir_n " \"%V\" failed", name);
+	for ( /* void */ ; p < end; p++) {
+
+		if (*p == '\\') {
+			if (++p == end) {
+				break;
+			}
+
+			if ((*p >= '1' && *p <= '9') || *p == 'g' || *p == 'k') {
+				return 1;
+			}
+
+			continue;
+		}
+
+		if (*p != '(' || end - p < 3 || p[1] != '?') {
+			continue;
+		}
+
+		switch (p[2]) {
+
+		case 'R': case '&':
+		case '0': case '1': case '2': case '3': case '4':
+		case '5': case '6': case '7': case '8': case '9':
+			return 1;
+
+		case '+': case '-':
+			if (end - p > 3 && p[3] >= '0' && p[3] <= '9') {
+				return 1;
+			}
+
+			break;
+
+		case 'P':
+			if (end - p > 3 && (p[3] == '=' || p[3] == '>')) {
+				return 1;
+			}
+
+			break;
+
+		case '(':
+			/* Unlike "(?(?=" and the like, which test a lookaround. */
+			if (end - p > 3 && p[3] != '?' && p[3] != '*') {
+				return 1;
+			}
+
+			break;
+		}
 	}
 
-	return r->header_sent ? NGX_ERROR : NGX_HTTP_INTERNAL_SERVER_ERROR;
+	return 0;
 }
 
+#endif
+
 
 static void *
 ngx_http_responsiveindex_create_loc_conf(ngx_conf_t *cf)
 {
 	ngx_http_responsiveindex_loc_conf_t  *conf;
 
-	conf = ngx_palloc(cf->pool, sizeof(ngx_http_responsiveindex_loc_conf_t));
+	conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_responsiveindex_loc_conf_t));
 	if (conf == NULL) {
 		return NULL;
 	}
@@ -650,6 +6545,21 @@ ngx_http_responsiveindex_create_loc_conf(ngx_conf_t *cf)
 	conf->enable = NGX_CONF_UNSET;
 	conf->localtime = NGX_CONF_UNSET;
 	conf->exact_size = NGX_CONF_UNSET;
+	conf->layout = NGX_CONF_UNSET_UINT;
+	conf->archive = NGX_CONF_UNSET;
+	conf->cache = NGX_CONF_UNSET_PTR;
+	conf->cache_valid = NGX_CONF_UNSET;
+	conf->cache_background_update = NGX_CONF_UNSET;
+	conf->prefetch = NGX_CONF_UNSET_UINT;
+	conf->prefetch_concurrency = NGX_CONF_UNSET_UINT;
+	conf->prefetch_budget = NGX_CONF_UNSET_MSEC;
+	conf->dir_size = NGX_CONF_UNSET_PTR;
+	conf->dir_size_valid = NGX_CONF_UNSET;
+	conf->parallel = NGX_CONF_UNSET_UINT;
+	conf->parallel_shards = NGX_CONF_UNSET_UINT;
+	conf->scan_batch = NGX_CONF_UNSET_UINT;
+	conf->scan_budget = NGX_CONF_UNSET_MSEC;
+	conf->io_uring = NGX_CONF_UNSET;
 
 	return conf;
 }
@@ -664,11 +6574,172 @@ ngx_http_responsiveindex_merge_loc_conf(ngx_conf_t *cf, void *parent, void *chil
 	ngx_conf_merge_value(conf->enable, prev->enable, 0);
 	ngx_conf_merge_value(conf->localtime, prev->localtime, 0);
 	ngx_conf_merge_value(conf->exact_size, prev->exact_size, 1);
+	ngx_conf_merge_uint_value(conf->layout, prev->layout,
+			NGX_HTTP_RESPONSIVEINDEX_LAYOUT_TABLE);
+	ngx_conf_merge_value(conf->archive, prev->archive, 0);
+	ngx_conf_merge_str_value(conf->archive_threads, prev->archive_threads, "");
+	ngx_conf_merge_ptr_value(conf->cache, prev->cache, NULL);
+	ngx_conf_merge_sec_value(conf->cache_valid, prev->cache_valid, 0);
+	ngx_conf_merge_value(conf->cache_background_update,
+			prev->cache_background_update, 0);
+	ngx_conf_merge_uint_value(conf->prefetch, prev->prefetch, 0);
+	ngx_conf_merge_uint_value(conf->prefetch_concurrency, prev->prefetch_concurrency, 1);
+	ngx_conf_merge_msec_value(conf->prefetch_budget, prev->prefetch_budget, 2);
+	ngx_conf_merge_ptr_value(conf->dir_size, prev->dir_size, NULL);
+	ngx_conf_merge_sec_value(conf->dir_size_valid, prev->dir_size_valid, 600);
+	ngx_conf_merge_str_value(conf->dir_size_threads, prev->dir_size_threads, "");
+	ngx_conf_merge_uint_value(conf->parallel, prev->parallel, 0);
+	ngx_conf_merge_uint_value(conf->parallel_shards, prev->parallel_shards, 4);
+	ngx_conf_merge_str_value(conf->parallel_threads, prev->parallel_threads, "");
+	ngx_conf_merge_uint_value(conf->scan_batch, prev->scan_batch, 0);
+	ngx_conf_merge_msec_value(conf->scan_budget, prev->scan_budget, 0);
+	ngx_conf_merge_value(conf->io_uring, prev->io_uring, 0);
+
+	if (conf->dir_size) {
+#if (NGX_THREADS)
+		conf->thread_pool = ngx_thread_pool_add(cf,
+				conf->dir_size_threads.len ? &conf->dir_size_threads : NULL);
+		if (conf->thread_pool == NULL) {
+			return NGX_CONF_ERROR;
+		}
+#else
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"\"responsiveindex_dir_size\" requires nginx built with thread pools");
+		return NGX_CONF_ERROR;
+#endif
+	}
+
+	/* Zip is only offered with a thread pool named for its checksums. */
+	if (conf->archive && conf->archive_threads.len) {
+#if (NGX_THREADS)
+		conf->archive_pool = ngx_thread_pool_add(cf, &conf->archive_threads);
+		if (conf->archive_pool == NULL) {
+			return NGX_CONF_ERROR;
+		}
+#else
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"\"responsiveindex_archive_threads\" requires nginx built with thread pools");
+		return NGX_CONF_ERROR;
+#endif
+	}
+
+	if (conf->parallel) {
+#if (NGX_THREADS)
+		conf->parallel_pool = ngx_thread_pool_add(cf,
+				conf->parallel_threads.len ? &conf->parallel_threads : NULL);
+		if (conf->parallel_pool == NULL) {
+			return NGX_CONF_ERROR;
+		}
+#else
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"\"responsiveindex_parallel\" requires nginx built with thread pools");
+		return NGX_CONF_ERROR;
+#endif
+	}
+
+	if (conf->exclude_patterns == NULL) {
+		conf->exclude_patterns = prev->exclude_patterns;
+#if (NGX_PCRE)
+		conf->exclude = prev->exclude;
+#endif
+	}
+
+	if (conf->include_patterns == NULL) {
+		conf->include_patterns = prev->include_patterns;
+#if (NGX_PCRE)
+		conf->include = prev->include;
+#endif
+	}
+
+#if (NGX_PCRE)
+
+	/* Compiled once, here, and shared with the locations inheriting them. */
+
+	if (conf->exclude_patterns && conf->exclude == NULL) {
+		conf->exclude = ngx_http_responsiveindex_compile(cf, conf->exclude_patterns);
+		if (conf->exclude == NULL) {
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	if (conf->include_patterns && conf->include == NULL) {
+		conf->include = ngx_http_responsiveindex_compile(cf, conf->include_patterns);
+		if (conf->include == NULL) {
+			return NGX_CONF_ERROR;
+		}
+	}
+
+#endif
+
+	if (ngx_http_responsiveindex_filter_key(cf, conf) != NGX_OK) {
+		return NGX_CONF_ERROR;
+	}
 
 	return NGX_CONF_OK;
 }
 
 
+static ngx_int_t
+ngx_http_responsiveindex_filter_key(ngx_conf_t *cf,
+		ngx_http_responsiveindex_loc_conf_t *conf)
+{
+	u_char		*p;
+	size_t		len;
+	ngx_str_t	*pattern;
+	ngx_uint_t	i, k;
+	ngx_array_t	*lists[2];
+
+	static u_char  tags[] = "ei";
+
+	lists[0] = conf->exclude_patterns;
+	lists[1] = conf->include_patterns;
+
+	len = 0;
+
+	for (k = 0; k < 2; k++) {
+		if (lists[k] == NULL) {
+			continue;
+		}
+
+		pattern = lists[k]->elts;
+
+		for (i = 0; i < lists[k]->nelts; i++) {
+			len += 1 + pattern[i].len + 1;
+		}
+	}
+
+	ngx_str_null(&conf->filter);
+
+	if (len == 0) {
+		return NGX_OK;
+	}
+
+	p = ngx_pnalloc(cf->pool, len);
+	if (p == NULL) {
+		return NGX_ERROR;
+	}
+
+	conf->filter.data = p;
+	conf->filter.len = len;
+
+	for (k = 0; k < 2; k++) {
+		if (lists[k] == NULL) {
+			continue;
+		}
+
+		pattern = lists[k]->elts;
+
+		for (i = 0; i < lists[k]->nelts; i++) {
+			*p++ = tags[k];
+			p = ngx_cpymem(p, pattern[i].data, pattern[i].len);
+			*p++ = '\0';
+		}
+	}
+
+	return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_responsiveindex_init(ngx_conf_t *cf)
 {
@@ -684,10 +6755,31 @@ ngx_http_responsiveindex_init(ngx_conf_t *cf)
 
 	*h = ngx_http_responsiveindex_handler;
 
+	ngx_sprintf(builtin_css_etag.data, "\"%08xD\"",
+			ngx_crc32_short(builtin_css.data, builtin_css.len));
+
+	return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_responsiveindex_init_process(ngx_cycle_t *cycle)
+{
+	ngx_queue_init(&ngx_http_responsiveindex_prefetch_queue);
+
 	return NGX_OK;
 }
 
 
+static void
+ngx_http_responsiveindex_exit_process(ngx_cycle_t *cycle)
+{
+#if (NGX_HAVE_IO_URING_STATX)
+	ngx_http_responsiveindex_uring_exit();
+#endif
+}
+
+
 static void
 ngx_http_responsiveindex_cpy_uri(ngx_buf_t *b, ngx_http_responsiveindex_entry_t *entry)
 {
@@ -714,7 +6806,7 @@ ngx_http_responsiveindex_cpy_size(ngx_buf_t *b, ngx_http_responsiveindex_entry_t
 	size_t size;
 	u_char scale;
 
-	if (entry->is_dir)
+	if (entry->is_dir && !entry->sized)
 		b->last = ngx_cpymem(b->last, "-", sizeof("-") - 1);
 	else
 	{
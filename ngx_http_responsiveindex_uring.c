@@ -0,0 +1,504 @@
+/*
+ * Batched statx() through io_uring: the lookups for a whole batch of
+ * directory entries are submitted at once and run concurrently, instead
+ * of one blocking stat() after another. The worker does not wait for
+ * them: the ring signals an eventfd the event loop watches, and whoever
+ * submitted a batch has its event posted once all of it is through.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+#include "ngx_http_responsiveindex_uring.h"
+
+
+#if (NGX_HAVE_IO_URING_STATX)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+
+#define NGX_HTTP_RESPONSIVEINDEX_URING_ENTRIES	256
+
+/* Most calls in one batch, so that a few listings can share the ring. */
+#define NGX_HTTP_RESPONSIVEINDEX_URING_BATCH	64
+
+
+struct ngx_http_responsiveindex_uring_s {
+	int						fd;
+
+	unsigned				*sq_head;
+	unsigned				*sq_tail;
+	unsigned				*sq_array;
+	unsigned				sq_mask;
+	unsigned				sq_entries;
+	struct io_uring_sqe		*sqes;
+
+	unsigned				*cq_head;
+	unsigned				*cq_tail;
+	unsigned				cq_mask;
+	struct io_uring_cqe		*cqes;
+
+	void					*sq_ring;
+	void					*cq_ring;
+	size_t					sq_ring_size;
+	size_t					cq_ring_size;
+	size_t					sqes_size;
+
+	/* The eventfd the ring signals completions on, in the event loop. */
+	ngx_connection_t		*connection;
+
+	/* Calls submitted and not reaped yet; at most sq_entries, so the CQ cannot overflow. */
+	ngx_uint_t				inflight;
+
+	/* io_uring_enter() failed: nothing more is submitted, what is in flight is still reaped. */
+	unsigned				failed:1;
+};
+
+
+static ngx_int_t ngx_http_responsiveindex_uring_init(ngx_http_responsiveindex_uring_t *ring,
+		ngx_log_t *log);
+static void ngx_http_responsiveindex_uring_handler(ngx_event_t *ev);
+static void ngx_http_responsiveindex_uring_reap(ngx_http_responsiveindex_uring_t *ring);
+static void ngx_http_responsiveindex_uring_close(ngx_http_responsiveindex_uring_t *ring);
+static void ngx_http_responsiveindex_uring_release(ngx_http_responsiveindex_batch_t *batch);
+
+
+/*
+ * One ring per worker, set up on first use (so never before the fork).
+ * Scans keep pointers to it, so it stays until the worker exits, even
+ * once it has failed; the worker then sticks to synchronous stat() calls.
+ */
+static ngx_http_responsiveindex_uring_t  *ngx_http_responsiveindex_ring;
+static ngx_uint_t  ngx_http_responsiveindex_ring_failed;
+
+
+ngx_http_responsiveindex_uring_t *
+ngx_http_responsiveindex_uring_get(ngx_log_t *log)
+{
+	ngx_http_responsiveindex_uring_t  *ring;
+
+	if (ngx_http_responsiveindex_ring) {
+		return ngx_http_responsiveindex_ring->failed ? NULL : ngx_http_responsiveindex_ring;
+	}
+
+	if (ngx_http_responsiveindex_ring_failed) {
+		return NULL;
+	}
+
+	ring = ngx_calloc(sizeof(ngx_http_responsiveindex_uring_t), log);
+	if (ring == NULL) {
+		ngx_http_responsiveindex_ring_failed = 1;
+		return NULL;
+	}
+
+	ring->fd = -1;
+
+	if (ngx_http_responsiveindex_uring_init(ring, log) != NGX_OK) {
+		ngx_http_responsiveindex_uring_close(ring);
+		ngx_http_responsiveindex_ring_failed = 1;
+		return NULL;
+	}
+
+	ngx_http_responsiveindex_ring = ring;
+
+	return ring;
+}
+
+
+/* The most statx() calls one batch can take. */
+ngx_uint_t
+ngx_http_responsiveindex_uring_size(ngx_http_responsiveindex_uring_t *ring)
+{
+	return ngx_min(ring->sq_entries, NGX_HTTP_RESPONSIVEINDEX_URING_BATCH);
+}
+
+
+/* Allocates a batch of n calls, with room for names bytes of names. */
+ngx_http_responsiveindex_batch_t *
+ngx_http_responsiveindex_uring_batch(ngx_uint_t n, size_t names, ngx_log_t *log)
+{
+	ngx_http_responsiveindex_batch_t  *batch;
+
+	batch = ngx_alloc(sizeof(ngx_http_responsiveindex_batch_t)
+			+ n * sizeof(ngx_http_responsiveindex_statx_t) + names, log);
+	if (batch == NULL) {
+		return NULL;
+	}
+
+	batch->sx = (ngx_http_responsiveindex_statx_t *) (batch + 1);
+	batch->n = n;
+	batch->pending = 0;
+	batch->event = NULL;
+	batch->names = (u_char *) (batch->sx + n);
+	batch->fd = -1;
+
+	return batch;
+}
+
+
+/*
+ * Submits the calls of a batch, relative to dirfd, without waiting for
+ * them; event is posted once each sx[i].res is set. The batch holds a
+ * dup() of dirfd until then, so the caller may close the directory any
+ * time. Returns NGX_OK, or NGX_DECLINED if the ring has no room for them
+ * now (or no descriptor could be had), or NGX_ERROR if the ring failed.
+ * Either way the caller still frees the batch with
+ * ngx_http_responsiveindex_uring_free().
+ */
+ngx_int_t
+ngx_http_responsiveindex_uring_submit(ngx_http_responsiveindex_uring_t *ring, int dirfd,
+		ngx_http_responsiveindex_batch_t *batch, ngx_event_t *event, ngx_log_t *log)
+{
+	long					rc;
+	unsigned				tail, unconsumed;
+	ngx_err_t				err;
+	ngx_uint_t				i, submit;
+	struct io_uring_sqe		*sqe;
+
+	if (ring->failed) {
+		return NGX_ERROR;
+	}
+
+	if (batch->n > ring->sq_entries - ring->inflight) {
+		return NGX_DECLINED;
+	}
+
+	batch->fd = dup(dirfd);
+
+	if (batch->fd == -1) {
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "dup() failed");
+		return NGX_DECLINED;
+	}
+
+	/* Only this process writes the submission tail. */
+	tail = *ring->sq_tail;
+
+	for (i = 0; i < batch->n; i++) {
+		sqe = &ring->sqes[tail & ring->sq_mask];
+
+		ngx_memzero(sqe, sizeof(struct io_uring_sqe));
+
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = batch->fd;
+		sqe->addr = (uintptr_t) batch->sx[i].name;
+		sqe->len = STATX_BASIC_STATS;
+		sqe->off = (uintptr_t) &batch->sx[i].stx;
+		sqe->statx_flags = AT_STATX_SYNC_AS_STAT;
+		sqe->user_data = (uintptr_t) &batch->sx[i];
+
+		batch->sx[i].batch = batch;
+
+		ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+		tail++;
+	}
+
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	batch->event = event;
+	batch->pending = batch->n;
+	ring->inflight += batch->n;
+
+	submit = batch->n;
+
+	while (submit) {
+		rc = syscall(__NR_io_uring_enter, ring->fd, (unsigned) submit, 0, 0, NULL, 0);
+
+		if (rc > 0) {
+			submit -= ngx_min((ngx_uint_t) rc, submit);
+			continue;
+		}
+
+		err = (rc == -1) ? ngx_errno : 0;
+
+		if (err == NGX_EINTR) {
+			continue;
+		}
+
+		ngx_log_error(NGX_LOG_ALERT, log, err, "io_uring_enter() failed");
+
+		/*
+		 * What the kernel did not take never completes. What it took
+		 * still does, so the batch lives on until that is reaped.
+		 */
+		unconsumed = tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+		batch->pending -= unconsumed;
+		ring->inflight -= unconsumed;
+		batch->event = NULL;
+
+		ring->failed = 1;
+
+		return NGX_ERROR;
+	}
+
+	/* Whatever completed right away need not wait for the eventfd. */
+	ngx_http_responsiveindex_uring_reap(ring);
+
+	return NGX_OK;
+}
+
+
+/* Frees a batch, or leaves it to be freed once the kernel is done with it. */
+void
+ngx_http_responsiveindex_uring_free(ngx_http_responsiveindex_batch_t *batch)
+{
+	if (batch->pending) {
+		batch->event = NULL;
+		return;
+	}
+
+	ngx_http_responsiveindex_uring_release(batch);
+}
+
+
+/* Called when the worker exits. */
+void
+ngx_http_responsiveindex_uring_exit(void)
+{
+	if (ngx_http_responsiveindex_ring) {
+		ngx_http_responsiveindex_uring_close(ngx_http_responsiveindex_ring);
+		ngx_http_responsiveindex_ring = NULL;
+	}
+}
+
+
+static void
+ngx_http_responsiveindex_uring_handler(ngx_event_t *ev)
+{
+	uint64_t							n;
+	ngx_connection_t					*c;
+
+	c = ev->data;
+
+	/* Only the count is kept there; the completions are in the ring. */
+	while (read(c->fd, &n, sizeof(uint64_t)) == sizeof(uint64_t)) {
+		/* void */
+	}
+
+	ngx_http_responsiveindex_uring_reap(c->data);
+}
+
+
+static void
+ngx_http_responsiveindex_uring_reap(ngx_http_responsiveindex_uring_t *ring)
+{
+	unsigned							head, tail;
+	struct io_uring_cqe					*cqe;
+	ngx_http_responsiveindex_batch_t	*batch;
+	ngx_http_responsiveindex_statx_t	*sx;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		cqe = &ring->cqes[head & ring->cq_mask];
+
+		sx = (ngx_http_responsiveindex_statx_t *) (uintptr_t) cqe->user_data;
+		sx->res = cqe->res;
+
+		batch = sx->batch;
+
+		head++;
+		ring->inflight--;
+
+		if (--batch->pending == 0) {
+			if (batch->event) {
+				ngx_post_event(batch->event, &ngx_posted_events);
+
+			} else {
+				ngx_http_responsiveindex_uring_release(batch);
+			}
+		}
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+static ngx_int_t
+ngx_http_responsiveindex_uring_init(ngx_http_responsiveindex_uring_t *ring, ngx_log_t *log)
+{
+	int						fd;
+	u_char					*p;
+	size_t					size;
+	ngx_uint_t				statx;
+	ngx_connection_t		*c;
+	struct io_uring_probe	*probe;
+	struct io_uring_params	params;
+
+	ngx_memzero(&params, sizeof(struct io_uring_params));
+
+	ring->fd = syscall(__NR_io_uring_setup, NGX_HTTP_RESPONSIVEINDEX_URING_ENTRIES,
+			&params);
+
+	if (ring->fd == -1) {
+		ngx_log_error(NGX_LOG_NOTICE, log, ngx_errno,
+				"io_uring_setup() failed, responsiveindex falls back to stat()");
+		return NGX_ERROR;
+	}
+
+	/* Kernels before 5.6 have neither IORING_REGISTER_PROBE nor IORING_OP_STATX. */
+
+	size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+
+	probe = ngx_calloc(size, log);
+	if (probe == NULL) {
+		return NGX_ERROR;
+	}
+
+	statx = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256)
+				!= -1
+			&& probe->last_op >= IORING_OP_STATX
+			&& (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+
+	ngx_free(probe);
+
+	if (!statx) {
+		ngx_log_error(NGX_LOG_NOTICE, log, 0,
+				"io_uring has no statx, responsiveindex falls back to stat()");
+		return NGX_ERROR;
+	}
+
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes
+		+ params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sq_ring_size = ngx_max(ring->sq_ring_size, ring->cq_ring_size);
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	p = mmap(NULL, ring->sq_ring_size, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+	if (p == MAP_FAILED) {
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "mmap() of io_uring failed");
+		return NGX_ERROR;
+	}
+
+	ring->sq_ring = p;
+
+	ring->sq_head = (unsigned *) (p + params.sq_off.head);
+	ring->sq_tail = (unsigned *) (p + params.sq_off.tail);
+	ring->sq_array = (unsigned *) (p + params.sq_off.array);
+	ring->sq_mask = *(unsigned *) (p + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+
+	} else {
+		p = mmap(NULL, ring->cq_ring_size, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+
+		if (p == MAP_FAILED) {
+			ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "mmap() of io_uring failed");
+			return NGX_ERROR;
+		}
+
+		ring->cq_ring = p;
+	}
+
+	p = ring->cq_ring;
+
+	ring->cq_head = (unsigned *) (p + params.cq_off.head);
+	ring->cq_tail = (unsigned *) (p + params.cq_off.tail);
+	ring->cq_mask = *(unsigned *) (p + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (p + params.cq_off.cqes);
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	p = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+	if (p == MAP_FAILED) {
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "mmap() of io_uring failed");
+		return NGX_ERROR;
+	}
+
+	ring->sqes = (struct io_uring_sqe *) p;
+
+	/* Completions wake up the event loop through an eventfd. */
+
+	fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (fd == -1) {
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "eventfd() failed");
+		return NGX_ERROR;
+	}
+
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_EVENTFD, &fd, 1) == -1) {
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+				"io_uring_register(IORING_REGISTER_EVENTFD) failed");
+		close(fd);
+		return NGX_ERROR;
+	}
+
+	c = ngx_get_connection(fd, log);
+	if (c == NULL) {
+		close(fd);
+		return NGX_ERROR;
+	}
+
+	ring->connection = c;
+
+	c->data = ring;
+	c->read->handler = ngx_http_responsiveindex_uring_handler;
+	c->read->log = log;
+
+	if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+		return NGX_ERROR;
+	}
+
+	ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+			"responsiveindex io_uring: %ui entries", (ngx_uint_t) ring->sq_entries);
+
+	return NGX_OK;
+}
+
+
+/* Closes the directory a batch was relative to, now that no call needs it, and frees it. */
+static void
+ngx_http_responsiveindex_uring_release(ngx_http_responsiveindex_batch_t *batch)
+{
+	if (batch->fd != -1) {
+		close(batch->fd);
+	}
+
+	ngx_free(batch);
+}
+
+
+/* Batches still in flight are left: the kernel may yet write into them. */
+static void
+ngx_http_responsiveindex_uring_close(ngx_http_responsiveindex_uring_t *ring)
+{
+	if (ring->connection) {
+		ngx_close_connection(ring->connection);
+	}
+
+	if (ring->sqes) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+
+	if (ring->sq_ring) {
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	}
+
+	if (ring->fd != -1) {
+		close(ring->fd);
+	}
+
+	ngx_free(ring);
+}
+
+#endif
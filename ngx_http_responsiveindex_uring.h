@@ -0,0 +1,68 @@
+#ifndef RESPONSIVEINDEX_URING_H
+#define RESPONSIVEINDEX_URING_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#if (NGX_HAVE_IO_URING_STATX)
+
+typedef struct ngx_http_responsiveindex_uring_s  ngx_http_responsiveindex_uring_t;
+typedef struct ngx_http_responsiveindex_batch_s  ngx_http_responsiveindex_batch_t;
+
+
+/* One statx() call to make through the ring. */
+typedef struct {
+	/* Relative to the directory, '\0'-terminated, within the batch. */
+	u_char								*name;
+
+	struct statx						stx;
+
+	/* 0, or the negated errno. */
+	int									res;
+
+	ngx_http_responsiveindex_batch_t	*batch;
+} ngx_http_responsiveindex_statx_t;
+
+
+/*
+ * statx() calls submitted together. A batch is allocated apart from any
+ * pool, since the kernel writes into it until the last call completes,
+ * whatever happens to the request meanwhile.
+ */
+struct ngx_http_responsiveindex_batch_s {
+	ngx_http_responsiveindex_statx_t	*sx;
+	ngx_uint_t							n;
+
+	/* Calls not completed yet. */
+	ngx_uint_t							pending;
+
+	/* Posted once they all are; NULL if nobody waits for them any more. */
+	ngx_event_t							*event;
+
+	/* Room for the names, n of them, each '\0'-terminated. */
+	u_char								*names;
+
+	/*
+	 * A dup() of the directory the names are relative to, closed only
+	 * once every call has completed, so its number cannot be reused for
+	 * another directory meanwhile (-1 until submitted).
+	 */
+	int									fd;
+};
+
+
+ngx_http_responsiveindex_uring_t *ngx_http_responsiveindex_uring_get(ngx_log_t *log);
+ngx_uint_t ngx_http_responsiveindex_uring_size(ngx_http_responsiveindex_uring_t *ring);
+ngx_http_responsiveindex_batch_t *ngx_http_responsiveindex_uring_batch(ngx_uint_t n,
+		size_t names, ngx_log_t *log);
+ngx_int_t ngx_http_responsiveindex_uring_submit(ngx_http_responsiveindex_uring_t *ring,
+		int dirfd, ngx_http_responsiveindex_batch_t *batch, ngx_event_t *event,
+		ngx_log_t *log);
+void ngx_http_responsiveindex_uring_free(ngx_http_responsiveindex_batch_t *batch);
+void ngx_http_responsiveindex_uring_exit(void);
+
+#endif
+
+
+#endif